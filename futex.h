@@ -0,0 +1,67 @@
+/*
+MIT License
+
+Copyright (c) 2018 Meng Rao <raomeng1@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+
+namespace tcpshm {
+
+// Thin wrappers of futex syscalls
+// Futex words in shm must not use FUTEX_PRIVATE_FLAG, as waiter and waker are in different processes
+
+// sleep while *addr == val for at most timeout_ns, return false on timeout or error
+inline bool FutexWait(uint32_t* addr, uint32_t val, int64_t timeout_ns) {
+    struct timespec ts;
+    ts.tv_sec = timeout_ns / 1000000000;
+    ts.tv_nsec = timeout_ns % 1000000000;
+    return syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, nullptr, 0) == 0;
+}
+
+inline void FutexWake(uint32_t* addr, bool is_private = false) {
+    syscall(SYS_futex, addr, is_private ? FUTEX_WAKE_PRIVATE : FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+inline void FutexSetWaiter(struct futex_waitv& w, uint32_t* addr, uint32_t val, bool is_private = false) {
+    w.val = val;
+    w.uaddr = (uint64_t)addr;
+    w.flags = FUTEX_32 | (is_private ? FUTEX_PRIVATE_FLAG : 0);
+    w.__reserved = 0;
+}
+
+// sleep until any of the cnt(no more than FUTEX_WAITV_MAX) futexes is woken or its value differs from the expected
+// one, for at most timeout_ns(linux 5.16+)
+// return false on timeout or error
+inline bool FutexWaitv(struct futex_waitv* waiters, uint32_t cnt, int64_t timeout_ns) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    timeout_ns += ts.tv_nsec;
+    ts.tv_sec += timeout_ns / 1000000000;
+    ts.tv_nsec = timeout_ns % 1000000000;
+    return syscall(SYS_futex_waitv, waiters, cnt, 0, &ts, CLOCK_MONOTONIC) >= 0;
+}
+} // namespace tcpshm
@@ -26,13 +26,31 @@ SOFTWARE.
 #include <sys/shm.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 
 namespace tcpshm {
 
+// mapping policy flags of my_mmap
+enum
+{
+    MMAP_HUGEPAGE = 1, // advise kernel to use transparent huge pages, effective for shm(tmpfs) files
+    MMAP_POPULATE = 2, // prefault all pages
+    MMAP_LOCK = 4,     // lock all pages in memory
+};
+
+// mapping policy of shm/ptcp queues configured in Conf
+template<class Conf>
+constexpr int MmapFlags() {
+    return (Conf::MmapHugePage ? MMAP_HUGEPAGE : 0) | (Conf::MmapPopulate ? MMAP_POPULATE : 0) |
+           (Conf::MemLock ? MMAP_LOCK : 0);
+}
+
 template<class T>
-T* my_mmap(const char* filename, bool use_shm, const char** error_msg) {
+T* my_mmap(const char* filename, bool use_shm, const char** error_msg, int flags = 0) {
     int fd = -1;
     if(use_shm) {
         fd = shm_open(filename, O_CREAT | O_RDWR, 0666);
@@ -49,12 +67,35 @@ T* my_mmap(const char* filename, bool use_shm, const char** error_msg) {
         close(fd);
         return nullptr;
     }
-    T* ret = (T*)mmap(0, sizeof(T), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // for huge page, populate after madvise or small pages would be faulted in
+    int populate = (flags & MMAP_POPULATE) && !(flags & MMAP_HUGEPAGE) ? MAP_POPULATE : 0;
+    T* ret = (T*)mmap(0, sizeof(T), PROT_READ | PROT_WRITE, MAP_SHARED | populate, fd, 0);
     close(fd);
     if(ret == MAP_FAILED) {
         *error_msg = "mmap";
         return nullptr;
     }
+    if(flags & MMAP_HUGEPAGE) {
+        // it's only an advice, so don't fail if not supported
+        madvise(ret, sizeof(T), MADV_HUGEPAGE);
+        if(flags & MMAP_POPULATE) {
+#ifdef MADV_POPULATE_WRITE
+            if(madvise(ret, sizeof(T), MADV_POPULATE_WRITE))
+#endif
+            {
+                // read fault pages in for older kernels, as the file could be being written by others
+                long page_size = sysconf(_SC_PAGESIZE);
+                for(size_t off = 0; off < sizeof(T); off += page_size) {
+                    (void)*(volatile char*)((char*)ret + off);
+                }
+            }
+        }
+    }
+    if((flags & MMAP_LOCK) && mlock(ret, sizeof(T))) {
+        munmap(ret, sizeof(T));
+        *error_msg = "mlock";
+        return nullptr;
+    }
     return ret;
 }
 
@@ -62,4 +103,73 @@ template<class T>
 void my_munmap(void* addr) {
     munmap(addr, sizeof(T));
 }
+
+// map anonymous private memory of size bytes, preferring numa_node if it's not negative
+// pages are faulted in by the first write after that, flags other than MMAP_POPULATE apply as in my_mmap
+inline void* my_mmap_arena(size_t size, int numa_node, const char** error_msg, int flags = 0) {
+    void* ret = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ret == MAP_FAILED) {
+        *error_msg = "mmap";
+        return nullptr;
+    }
+    if(numa_node >= 0) {
+        unsigned long nodemask[16] = {};
+        const int word_bits = sizeof(unsigned long) * 8;
+        if(numa_node >= (int)sizeof(nodemask) * 8) {
+            munmap(ret, size);
+            *error_msg = "invalid numa node";
+            errno = EINVAL;
+            return nullptr;
+        }
+        nodemask[numa_node / word_bits] = 1UL << (numa_node % word_bits);
+        // set before any page is faulted in, no glibc wrapper so libnuma is not needed
+        if(syscall(SYS_mbind, ret, size, MPOL_PREFERRED, nodemask, sizeof(nodemask) * 8, 0)) {
+            munmap(ret, size);
+            *error_msg = "mbind";
+            return nullptr;
+        }
+    }
+    if(flags & MMAP_HUGEPAGE) madvise(ret, size, MADV_HUGEPAGE);
+    if((flags & MMAP_LOCK) && mlock(ret, size)) {
+        munmap(ret, size);
+        *error_msg = "mlock";
+        return nullptr;
+    }
+    return ret;
+}
+
+inline void my_munmap_arena(void* addr, size_t size) {
+    munmap(addr, size);
+}
+
+// map an anonymous memory file of size bytes twice back to back, so data wrapping around the end is contiguous
+// size must be a multiple of page size
+inline char* my_mmap_vring(uint32_t size, const char** error_msg) {
+    int fd = memfd_create("tcpshm_vring", 0);
+    if(fd == -1) {
+        *error_msg = "memfd_create";
+        return nullptr;
+    }
+    if(ftruncate(fd, size)) {
+        *error_msg = "ftruncate";
+        close(fd);
+        return nullptr;
+    }
+    // reserve address space for both mappings first
+    char* ret = (char*)mmap(0, size * 2UL, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ret == MAP_FAILED ||
+       mmap(ret, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+       mmap(ret + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        if(ret != MAP_FAILED) munmap(ret, size * 2UL);
+        *error_msg = "mmap";
+        close(fd);
+        return nullptr;
+    }
+    close(fd);
+    return ret;
+}
+
+inline void my_munmap_vring(char* addr, uint32_t size) {
+    munmap(addr, size * 2UL);
+}
 } // namespace tcpshm
@@ -0,0 +1,123 @@
+/*
+MIT License
+
+Copyright (c) 2018 Meng Rao <raomeng1@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include "msg_header.h"
+#include <string.h>
+
+namespace tcpshm {
+
+// Multiple producer single consumer in-process queue of 8 byte blocks, for staging msgs from any thread
+// Each msg is preceded by an entry block, producers reserve blocks by CAS on write_idx then fill the msg and commit
+// the entry, consumer takes committed msgs in order, so a msg allocated but not yet pushed holds back later ones
+// Blocks are zeroed by consumer after use, so an entry is never seen committed before its producer commits it
+template<uint32_t Bytes>
+class MPSCVarQueue
+{
+public:
+    static constexpr uint32_t BLK_CNT = Bytes / sizeof(MsgHeader);
+    static_assert(BLK_CNT && !(BLK_CNT & (BLK_CNT - 1)), "BLK_CNT must be a power of 2");
+
+    // for producers, can be called from any thread
+    // allocate a msg which is always contiguous in queue, return nullptr if no enough space
+    MsgHeader* Alloc(uint32_t size) {
+        size += sizeof(MsgHeader);
+        uint32_t blk_sz = (size + sizeof(MsgHeader) - 1) / sizeof(MsgHeader) + 1; // including the entry
+        uint32_t idx = __atomic_load_n(&write_idx, __ATOMIC_RELAXED);
+        uint32_t padding_sz;
+        while(true) {
+            padding_sz = BLK_CNT - (idx % BLK_CNT);
+            if(blk_sz <= padding_sz) padding_sz = 0;
+            uint32_t new_idx = idx + padding_sz + blk_sz;
+            // read_idx could be newer than idx, then CAS fails anyway
+            if((int)(new_idx - __atomic_load_n(&read_idx, __ATOMIC_ACQUIRE)) > (int)BLK_CNT) return nullptr;
+            if(__atomic_compare_exchange_n(&write_idx, &idx, new_idx, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        if(padding_sz) { // tail is too small for the msg, it's committed as padding right away
+            Commit(idx, padding_sz, PADDING);
+            idx += padding_sz;
+        }
+        blk[idx % BLK_CNT].entry.blk_sz = blk_sz;
+        MsgHeader& header = blk[(idx + 1) % BLK_CNT].header;
+        header.SetSize(size);
+        return &header;
+    }
+
+    // for producers, submit a msg from Alloc()
+    void Push(MsgHeader* header) {
+        Entry& entry = (reinterpret_cast<Block*>(header) - 1)->entry;
+        __atomic_store_n(&entry.state, COMMITTED, __ATOMIC_RELEASE);
+    }
+
+    // for consumer, return the first msg if it's committed
+    MsgHeader* Front() {
+        while(true) {
+            Block* b = &blk[read_idx % BLK_CNT];
+            uint32_t state = __atomic_load_n(&b->entry.state, __ATOMIC_ACQUIRE);
+            if(state == COMMITTED) return &(b + 1)->header;
+            if(state != PADDING) return nullptr;
+            Pop();
+        }
+    }
+
+    // for consumer, consume the msg from Front()
+    void Pop() {
+        Block* b = &blk[read_idx % BLK_CNT];
+        uint32_t blk_sz = b->entry.blk_sz;
+        // entries of later msgs could start at any of these blocks
+        memset(b, 0, blk_sz * sizeof(Block));
+        __atomic_store_n(&read_idx, read_idx + blk_sz, __ATOMIC_RELEASE);
+    }
+
+private:
+    static const uint32_t COMMITTED = 1;
+    static const uint32_t PADDING = 2;
+
+    struct Entry // precedes each msg
+    {
+        uint32_t blk_sz;
+        uint32_t state;
+    };
+
+    union Block
+    {
+        Entry entry;
+        MsgHeader header;
+    };
+    static_assert(sizeof(Block) == sizeof(MsgHeader), "Entry must fit in a block");
+
+    void Commit(uint32_t idx, uint32_t blk_sz, uint32_t state) {
+        Entry& entry = blk[idx % BLK_CNT].entry;
+        entry.blk_sz = blk_sz;
+        __atomic_store_n(&entry.state, state, __ATOMIC_RELEASE);
+    }
+
+    Block blk[BLK_CNT] = {};
+
+    alignas(64) uint32_t write_idx = 0; // shared by producers
+
+    alignas(64) uint32_t read_idx = 0; // written by consumer only
+};
+} // namespace tcpshm
@@ -30,13 +30,31 @@ namespace tcpshm {
 struct MsgHeader
 {
     // size of this msg, including header itself
-    // auto set by lib, can be read by user
+    // auto set by lib, can be read by user, but it's LARGE_SIZE for a large msg so GetSize() is preferred
     uint16_t size;
     // msg type of app msg is set by user and must not be 0
     uint16_t msg_type;
     // internally used for ptcp, must not be modified by user
+    // for a large msg it's the real size instead
     uint32_t ack_seq;
 
+    // size of a msg that doesn't fit in uint16_t, see Conf::LargeMsg
+    static const uint16_t LARGE_SIZE = 0xFFFF;
+
+    uint32_t GetSize() const {
+        return size == LARGE_SIZE ? ack_seq : size;
+    }
+
+    // auto called by lib
+    void SetSize(uint32_t sz) {
+        if(sz < LARGE_SIZE) {
+            size = sz;
+            return;
+        }
+        size = LARGE_SIZE;
+        ack_seq = sz;
+    }
+
     template<bool ToLittle>
     void ConvertByteOrder() {
         Endian<ToLittle> ed;
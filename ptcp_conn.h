@@ -24,9 +24,14 @@ SOFTWARE.
 
 #pragma once
 #include "ptcp_queue.h"
+#include "ptcp_log.h"
+#include "uring.h"
 #include "mmap.h"
 #include <memory>
+#include <limits>
 #include <sys/uio.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
 
 namespace tcpshm {
 
@@ -59,8 +64,46 @@ struct LoginMsgTpl
     }
 };
 
+// for shm doorbell, the group of the connection and its bit in group's doorbell
+// they're in LoginRspMsg only if Conf::ShmDoorbell is set, so the default login rsp layout is not changed
+template<bool ShmDoorbell, bool ToLittleEndian>
+struct LoginRspShmBell
+{
+    uint32_t shm_grpid;
+    uint32_t shm_bell_idx;
+
+    void SetShmBell(uint32_t grpid, uint32_t bell_idx) {
+        shm_grpid = grpid;
+        shm_bell_idx = bell_idx;
+    }
+    uint32_t GetShmGrpId() const {
+        return shm_grpid;
+    }
+    uint32_t GetShmBellIdx() const {
+        return shm_bell_idx;
+    }
+    void ConvertByteOrder() {
+        Endian<ToLittleEndian> ed;
+        ed.ConvertInPlace(shm_grpid);
+        ed.ConvertInPlace(shm_bell_idx);
+    }
+};
+
+template<bool ToLittleEndian>
+struct LoginRspShmBell<false, ToLittleEndian>
+{
+    void SetShmBell(uint32_t, uint32_t) {}
+    uint32_t GetShmGrpId() const {
+        return 0;
+    }
+    uint32_t GetShmBellIdx() const {
+        return 0;
+    }
+    void ConvertByteOrder() {}
+};
+
 template<class Conf>
-struct LoginRspMsgTpl
+struct LoginRspMsgTpl : public LoginRspShmBell<Conf::ShmDoorbell, Conf::ToLittleEndian>
 {
     static const uint16_t msg_type = 2;
     uint32_t server_seq_start;
@@ -76,6 +119,7 @@ struct LoginRspMsgTpl
         Endian<Conf::ToLittleEndian> ed;
         ed.ConvertInPlace(server_seq_start);
         ed.ConvertInPlace(server_seq_end);
+        LoginRspShmBell<Conf::ShmDoorbell, Conf::ToLittleEndian>::ConvertByteOrder();
     }
 };
 
@@ -94,56 +138,132 @@ public:
     bool OpenFile(const char* ptcp_queue_file,
                   const char** error_msg) {
         if(!q_) {
-            q_ = my_mmap<PTCPQ>(ptcp_queue_file, false, error_msg);
+            q_ = my_mmap<PTCPQ>(ptcp_queue_file, false, error_msg, MmapFlags<Conf>());
             if(!q_) return false;
         }
+        if(Conf::TcpLogSegmentSize && !log_.Open(ptcp_queue_file, error_msg)) return false;
         return true;
     }
 
     bool GetSeq(uint32_t* local_ack_seq, uint32_t* local_seq_start, uint32_t* local_seq_end) {
         *local_ack_seq = q_->MyAck();
-        return q_->SanityCheckAndGetSeq(local_seq_start, local_seq_end);
+        if(!q_->SanityCheckAndGetSeq(local_seq_start, local_seq_end)) return false;
+        return !Conf::TcpLogSegmentSize || log_.SanityCheck(*local_seq_end);
     }
 
     void Reset() {
         memset(q_, 0, sizeof(PTCPQ));
+        if(Conf::TcpLogSegmentSize) log_.Reset();
     }
 
     void Release() {
         Close("Release", 0);
         TryCloseFd();
+        uring_ = nullptr; // uring is released together
+        uring_head_ = uring_tail_ = 0;
         if(q_) {
             my_munmap<PTCPQ>(q_);
             q_ = nullptr;
         }
+        if(Conf::TcpLogSegmentSize) log_.Close();
     }
 
     // precondition: sockfd_ == fd_to_close_ == -1
     void Open(int sock_fd, uint32_t remote_ack_seq, int64_t now) {
         sockfd_ = fd_to_close_ = sock_fd;
         writeidx_ = readidx_ = nextmsg_idx_ = 0;
+        if(Conf::TcpZeroCopyMin) {
+            // fall back to copying if not supported
+            int one = 1;
+            zerocopy_ = q_ && setsockopt(sock_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+            zc_sent_ = zc_done_ = 0;
+        }
         recv_time_ = send_time_ = now_ = now;
         if(q_) {
+            // remote side has got our ack seq in login
+            ack_sent_ = push_ack_ = q_->AckToSend();
             q_->LoginAck(remote_ack_seq);
             SendPending();
         }
+        asm volatile("" : : "m"(sockfd_) :);
+        uring_gen_++;
         if(recvbuf_size_ == 0) {
-            recvbuf_size_ = Conf::TcpRecvBufInitSize;
-            recvbuf_.reset(new char[recvbuf_size_]);
+            if(Conf::TcpRecvBufVRing) {
+                const char* error_msg;
+                recvbuf_.reset(my_mmap_vring(Conf::TcpRecvBufMaxSize, &error_msg));
+                if(!recvbuf_) {
+                    Close("Vring mmap error", errno);
+                    return;
+                }
+                recvbuf_size_ = Conf::TcpRecvBufMaxSize;
+            }
+            else {
+                recvbuf_size_ = Conf::TcpRecvBufInitSize;
+                recvbuf_.reset(new char[recvbuf_size_]);
+            }
+            // for vring, both mappings are locked but it's the same memory
+            if(Conf::MemLock && mlock(&recvbuf_[0], recvbuf_size_ * (Conf::TcpRecvBufVRing ? 2 : 1)))
+                Close("Mlock error", errno);
         }
     }
 
-    MsgHeader* Alloc(uint16_t size) {
+    MsgHeader* Alloc(uint32_t size) {
+        if(FlushPolicy) alloc_size_ = size + sizeof(MsgHeader);
+        if(Conf::TcpLogSegmentSize) {
+            // keep msgs in order: once a msg goes to the log, the following ones go there too until it's drained
+            alloc_in_log_ = !log_.Empty();
+            MsgHeader* header;
+            if(!alloc_in_log_ && (header = q_->Alloc(size))) return header;
+            alloc_in_log_ = true;
+            return log_.Alloc(size);
+        }
         return q_->Alloc(size);
     }
 
     void Push() {
-        q_->Push();
+        PushMore();
         SendPending();
     }
 
     void PushMore() {
+        if(Conf::TcpLogSegmentSize && alloc_in_log_) {
+            log_.Push(q_->WriteSeq());
+            return;
+        }
+        bool had_timer = (Durable && q_->NeedSync()) || unflushed_bytes_;
         q_->Push();
+        push_ack_ = q_->MyAck();
+        // in durable mode, msgs are sent out only after synced
+        if(Conf::TcpSyncBatch && q_->UnsyncedCnt() >= Conf::TcpSyncBatch) Sync();
+        if(FlushPolicy) {
+            if(unflushed_bytes_ == 0) unflushed_time_ = now_;
+            unflushed_bytes_ += alloc_size_;
+            if(Conf::TcpFlushBytes && unflushed_bytes_ >= Conf::TcpFlushBytes) SendPending();
+        }
+        // a sync or flush is due now, while the connection could be waiting in epoll with a later timer
+        if(timer_bits_ && !had_timer && ((Durable && q_->NeedSync()) || unflushed_bytes_)) MarkTimer();
+    }
+
+    // for epoll on server side, the bitmap of the group to mark once the timer of this connection could be earlier,
+    // and our bit in it
+    void SetTimerBits(uint64_t* bits, uint32_t idx) {
+        timer_bits_ = bits;
+        timer_idx_ = idx;
+    }
+
+    // sync pushed msgs to disk
+    bool Sync() {
+        if(q_->Sync()) return true;
+        Close("Sync error", errno);
+        return false;
+    }
+
+    uint32_t GetWriteSeq() {
+        return q_->WriteSeq();
+    }
+
+    uint32_t GetDurableSeq() {
+        return q_->DurableSeq();
     }
 
     // safe if IsClosed
@@ -172,12 +292,13 @@ public:
                 if(old_writeidx - (int)nextmsg_idx_ < 8) { // we haven't converted this header
                     header->ConvertByteOrder<Conf::ToLittleEndian>();
                 }
-                q_->Ack(header->ack_seq);
-                int msg_size = (header->size + 7) & -8;
+                if(header->size != MsgHeader::LARGE_SIZE) q_->Ack(header->ack_seq);
+                uint32_t msg_size = header->GetSize();
                 if(msg_size > Conf::TcpRecvBufMaxSize) {
                     Close("Msg size larger than recv buf max size", 0);
                     return nullptr;
                 }
+                msg_size = (msg_size + 7) & -8;
                 if(writeidx_ - nextmsg_idx_ < msg_size) break;
                 // we have got a full msg
                 if(header->msg_type == HeartbeatMsg::msg_type && readidx_ == nextmsg_idx_) {
@@ -195,36 +316,91 @@ public:
     // we have consumed the msg we got from Front()
     void Pop() {
         MsgHeader* header = (MsgHeader*)&recvbuf_[readidx_];
-        readidx_ += (header->size + 7) & -8;
+        readidx_ += (header->GetSize() + 7) & -8;
         q_->MyAck()++;
+        if(AckPolicy) consumed_bytes_ += header->GetSize();
+    }
+
+    // get up to max_cnt complete msgs in recv buffer, starting from the one Front() returned
+    // it doesn't read from socket, return the number got
+    uint32_t FrontBatch(MsgHeader** headers, uint32_t max_cnt) {
+        uint32_t cnt = 0;
+        for(uint32_t idx = readidx_; idx != nextmsg_idx_ && cnt < max_cnt;) {
+            MsgHeader* header = (MsgHeader*)&recvbuf_[idx];
+            if(header->msg_type != HeartbeatMsg::msg_type) headers[cnt++] = header;
+            idx += (header->GetSize() + 7) & -8;
+        }
+        return cnt;
+    }
+
+    // we have consumed cnt msgs we got from FrontBatch(), skipping heartbeats in between
+    void PopN(uint32_t cnt) {
+        for(uint32_t i = 0; i < cnt;) {
+            MsgHeader* header = (MsgHeader*)&recvbuf_[readidx_];
+            if(header->msg_type != HeartbeatMsg::msg_type) {
+                i++;
+                if(AckPolicy) consumed_bytes_ += header->GetSize();
+            }
+            readidx_ += (header->GetSize() + 7) & -8;
+        }
+        q_->MyAck() += cnt;
     }
 
     // safe if IsClosed
     void SendHB(int64_t now) {
         now_ = now;
-        if(now_ - send_time_ < Conf::HeartBeatInverval) return;
-        if(q_) {
-            if(SendPending()) return;
-            hbmsg_.ack_seq = Endian<Conf::ToLittleEndian>::Convert(q_->MyAck());
+        if(Conf::TcpLogSegmentSize && q_ && !log_.Empty()) SendPending();
+        if(Conf::TcpSyncBatch && q_) {
+            if(!q_->NeedSync())
+                unsynced_time_ = now_;
+            else if(now_ - unsynced_time_ >= Conf::TcpSyncInterval && Sync())
+                SendPending();
         }
-        int sent = ::send(sockfd_, &hbmsg_, sizeof(hbmsg_), MSG_NOSIGNAL);
-        if(sent < 0 && errno == EAGAIN) return;
-        if(sent != sizeof(MsgHeader)) { // for simplicity, we see partial sendout as error
-            Close("Send error", sent < 0 ? errno : 0);
-            return;
+        if(Conf::TcpFlushDelay && unflushed_bytes_ && now_ - unflushed_time_ >= Conf::TcpFlushDelay) SendPending();
+        if(AckPolicy && q_) {
+            // an ack-only frame is just a heartbeat sent earlier
+            if(q_->AckToSend() == ack_sent_)
+                unacked_time_ = now_;
+            else if(now_ >= AckDueTime()) {
+                if(!SendPending() && SendHBMsg()) ack_time_ = now_;
+                return;
+            }
         }
-        send_time_ = now_; // successfully sent
+        if(now_ - send_time_ < Conf::HeartBeatInverval) return;
+        if(q_ && SendPending()) return;
+        SendHBMsg();
     }
 
     // return false only if no pending data to send
     bool SendPending() {
         if(IsClosed()) return false;
-        int blk_sz;
-        const char* p = (char*)q_->GetSendable(blk_sz);
-        if(blk_sz == 0) return false;
-        uint32_t size = blk_sz << 3;
+        if(Conf::TcpLogSegmentSize) DrainLog();
+        int blk_sz, wrap_blk_sz;
+        MsgHeader* p = q_->GetSendable(blk_sz, wrap_blk_sz);
+        if(blk_sz + wrap_blk_sz == 0) return false;
+        // pending data could be split into 2 segments if ptcp queue is wrapped
+        struct iovec vec[2];
+        vec[0].iov_base = p;
+        vec[0].iov_len = blk_sz << 3;
+        vec[1].iov_base = q_->GetHead();
+        vec[1].iov_len = wrap_blk_sz << 3;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vec;
+        msg.msg_iovlen = wrap_blk_sz ? 2 : 1;
+        uint32_t size = (blk_sz + wrap_blk_sz) << 3;
+        int flags = MSG_NOSIGNAL;
+        if(Conf::TcpZeroCopyMin && zerocopy_ && size >= Conf::TcpZeroCopyMin) {
+            ReapZeroCopy();
+            flags |= MSG_ZEROCOPY;
+        }
         do {
-            int sent = ::send(sockfd_, p, size, MSG_NOSIGNAL);
+            int sent = ::sendmsg(sockfd_, &msg, flags);
+            if(sent < 0 && (flags & MSG_ZEROCOPY) && errno == ENOBUFS) { // out of socket memory for pinning pages
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+            if((flags & MSG_ZEROCOPY) && sent >= 0) zc_sent_++;
             if(sent < 0) {
                 if(errno != EAGAIN || (size & 7)) {
                     Close("Send error", errno);
@@ -233,14 +409,28 @@ public:
                 else
                     break;
             }
-            p += sent;
             size -= sent;
+            while(sent > 0) {
+                if((uint32_t)sent < msg.msg_iov->iov_len) {
+                    msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + sent;
+                    msg.msg_iov->iov_len -= sent;
+                    break;
+                }
+                sent -= msg.msg_iov->iov_len;
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
         } while(size > 0);
-        int sent_blk = blk_sz - (size >> 3);
+        int sent_blk = blk_sz + wrap_blk_sz - (size >> 3);
         if(sent_blk > 0) {
             send_time_ = now_;
             q_->Sendout(sent_blk);
         }
+        if(size == 0) {
+            unflushed_bytes_ = 0;
+            // all pushed msgs are sent, so remote side has got the ack seq in the last one
+            if(AckPolicy && !Durable) SetAckSent(push_ack_);
+        }
         return true;
     }
 
@@ -251,6 +441,8 @@ public:
     // not thread safe
     bool TryCloseFd() {
         if(sockfd_ < 0 && fd_to_close_ >= 0) {
+            // pending recv in io_uring holds a reference of the socket, shutdown to terminate it
+            if(uring_) ::shutdown(fd_to_close_, SHUT_RDWR);
             ::close(fd_to_close_);
             fd_to_close_ = -1;
             return true;
@@ -263,14 +455,75 @@ public:
         return close_reason_;
     }
 
-    void RequestClose() {
-        Close("Request close", 0);
+    void RequestClose(const char* reason = "Request close", int sys_errno = 0) {
+        Close(reason, sys_errno);
+    }
+
+    // if the last recv stopped because no more data was available
+    bool RecvWouldBlock() {
+        return recv_would_block_;
+    }
+
+    // when SendHB and timeout check need to be done again if nothing happens on this connection in between
+    int64_t NextTimerTime() {
+        int64_t t = std::min(send_time_ + Conf::HeartBeatInverval, recv_time_ + Conf::ConnectionTimeout);
+        if(Conf::TcpSyncBatch && q_ && q_->NeedSync()) t = std::min(t, unsynced_time_ + Conf::TcpSyncInterval);
+        if(AckPolicy && q_ && q_->AckToSend() != ack_sent_) t = std::min(t, AckDueTime());
+        if(Conf::TcpFlushDelay && unflushed_bytes_) t = std::min(t, unflushed_time_ + Conf::TcpFlushDelay);
+        return t;
+    }
+
+    // called in polling when there's no msg to handle, flush msgs from PushMore() if Conf::TcpFlushOnIdle
+    void OnIdle() {
+        if(Conf::TcpFlushOnIdle && unflushed_bytes_) SendPending();
     }
 
     bool UseShm() {
         return q_ == nullptr;
     }
 
+    // for io_uring, called in the polling thread on each poll to make sure there's a recv in flight if it's open
+    // id is used to tag recv completions of this connection
+    // return false if submission queue is full
+    bool UringPrepare(TcpUring* uring, uint32_t id) {
+        if(IsClosed()) { // received buffers are no longer needed
+            if(uring_ == uring) UringDropRecv();
+            return true;
+        }
+        if(uring_ != uring || uring_conn_gen_ != uring_gen_) { // a new connection is opened
+            UringDropRecv();
+            if(!uring_chunks_ || uring_ != uring) uring_chunks_.reset(new UringChunk[uring->BufCnt()]);
+            uring_ = uring;
+            uring_conn_gen_ = uring_gen_;
+            uring_armed_ = false;
+            uring_err_ = 0;
+        }
+        // multishot recv could be terminated, e.g. no buffer available, rearm it after consuming what we've got
+        if(uring_armed_ || uring_err_ || uring_head_ != uring_tail_) return true;
+        if(!uring->Recv(sockfd_, ((uint64_t)uring_conn_gen_ << 32) | id)) return false;
+        uring_armed_ = true;
+        return true;
+    }
+
+    // for io_uring, called in the polling thread on a recv completion
+    void UringOnRecv(TcpUring* uring, uint32_t gen, int res, uint32_t flags) {
+        // for a closed connection, or a reopened one UringPrepare hasn't switched to yet
+        if(uring != uring_ || gen != uring_conn_gen_ || uring_conn_gen_ != uring_gen_ || IsClosed()) {
+            if(flags & IORING_CQE_F_BUFFER) uring->RecycleBuf(flags >> IORING_CQE_BUFFER_SHIFT);
+            return;
+        }
+        if(!(flags & IORING_CQE_F_MORE)) uring_armed_ = false;
+        if(res > 0) {
+            UringChunk& chunk = uring_chunks_[uring_tail_++ & (uring_->BufCnt() - 1)];
+            chunk.bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            chunk.len = res;
+        }
+        else if(res == 0)
+            uring_err_ = -1;
+        else if(res != -ENOBUFS)
+            uring_err_ = -res;
+    }
+
 private:
     // thread safe
     // need to call TryCloseFd to really close it
@@ -281,33 +534,165 @@ private:
         close_errno_ = sys_errno;
     }
 
+    // same as readv but reading from buffers io_uring has received
+    int UringRead(struct iovec* vec, int cnt) {
+        if(uring_conn_gen_ != uring_gen_) { // what we've got is from the previous connection
+            UringDropRecv();
+            errno = EAGAIN;
+            return -1;
+        }
+        int ret = 0;
+        while(uring_head_ != uring_tail_ && cnt > 0) {
+            UringChunk& chunk = uring_chunks_[uring_head_ & (uring_->BufCnt() - 1)];
+            uint32_t len = std::min(chunk.len - uring_offset_, (uint32_t)vec->iov_len);
+            memcpy(vec->iov_base, uring_->GetBuf(chunk.bid) + uring_offset_, len);
+            ret += len;
+            vec->iov_base = (char*)vec->iov_base + len;
+            if((vec->iov_len -= len) == 0) {
+                vec++;
+                cnt--;
+            }
+            if((uring_offset_ += len) == chunk.len) {
+                uring_->RecycleBuf(chunk.bid);
+                uring_head_++;
+                uring_offset_ = 0;
+            }
+        }
+        if(ret > 0) return ret;
+        if(uring_err_ < 0) return 0; // remote close
+        errno = uring_err_ ? uring_err_ : EAGAIN;
+        return -1;
+    }
+
+    void UringDropRecv() {
+        for(; uring_head_ != uring_tail_; uring_head_++) {
+            uring_->RecycleBuf(uring_chunks_[uring_head_ & (uring_->BufCnt() - 1)].bid);
+        }
+        uring_offset_ = 0;
+    }
+
+    // read completion notifications of MSG_ZEROCOPY sends from socket error queue, or they'd use up socket memory
+    // note that we don't need to wait for completions before reusing the blocks in ptcp queue, as they're reused only
+    // after remote side acked them, which means kernel has already got the tcp ack for them
+    void ReapZeroCopy() {
+        char control[128];
+        while(zc_done_ != zc_sent_) {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if(::recvmsg(sockfd_, &msg, MSG_ERRQUEUE) < 0) return;
+            for(struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cm);
+                // a notification covers a range of sends
+                if(err->ee_origin == SO_EE_ORIGIN_ZEROCOPY) zc_done_ += err->ee_data - err->ee_info + 1;
+            }
+        }
+    }
+
+    // send hbmsg_ carrying the latest ack seq, return true if sent
+    bool SendHBMsg() {
+        uint32_t ack_seq = 0;
+        if(q_) {
+            ack_seq = q_->AckToSend();
+            hbmsg_.ack_seq = Endian<Conf::ToLittleEndian>::Convert(ack_seq);
+        }
+        int sent = ::send(sockfd_, &hbmsg_, sizeof(hbmsg_), MSG_NOSIGNAL);
+        if(sent < 0 && errno == EAGAIN) return false;
+        if(sent != sizeof(MsgHeader)) { // for simplicity, we see partial sendout as error
+            Close("Send error", sent < 0 ? errno : 0);
+            return false;
+        }
+        send_time_ = now_; // successfully sent
+        if(AckPolicy && q_) SetAckSent(ack_seq);
+        return true;
+    }
+
+    void SetAckSent(uint32_t ack_seq) {
+        if((int)(ack_seq - ack_sent_) <= 0) return;
+        ack_sent_ = ack_seq;
+        acked_bytes_ = consumed_bytes_;
+    }
+
+    // precondition: some consumed msgs are not acked to remote side
+    // when an ack-only frame is due according to ack policy, paced by Conf::TcpAckMinInterval
+    int64_t AckDueTime() {
+        int64_t t = std::numeric_limits<int64_t>::max();
+        if(Conf::TcpAckDelay) t = unacked_time_ + Conf::TcpAckDelay;
+        if((Conf::TcpAckMsgs && q_->AckToSend() - ack_sent_ >= Conf::TcpAckMsgs) ||
+           (Conf::TcpAckBytes && consumed_bytes_ - acked_bytes_ >= Conf::TcpAckBytes))
+            t = unacked_time_;
+        return std::max(t, ack_time_ + Conf::TcpAckMinInterval);
+    }
+
+    void MarkTimer() {
+        __atomic_fetch_or(&timer_bits_[timer_idx_ / 64], 1ULL << (timer_idx_ % 64), __ATOMIC_RELEASE);
+    }
+
+    // move msgs from log into ptcp queue as long as it has space
+    void DrainLog() {
+        while(!log_.Empty()) {
+            MsgHeader* header = log_.Front();
+            if(!header) {
+                Close("Log mmap error", errno);
+                return;
+            }
+            uint32_t size = header->GetSize() - sizeof(MsgHeader);
+            MsgHeader* dest = q_->Alloc(size);
+            if(!dest) break;
+            dest->msg_type = header->msg_type;
+            memcpy(dest + 1, header + 1, size);
+            q_->Push();
+            push_ack_ = q_->MyAck();
+            log_.Pop(q_->WriteSeq());
+        }
+    }
+
     int DoRecv() {
         char stackbuf[65536];
-        if(readidx_ > 0 && readidx_ == writeidx_) {
-            readidx_ = nextmsg_idx_ = writeidx_ = 0;
-        }
-        uint32_t writable = recvbuf_size_ - writeidx_;
-        // we should avoid buffer expansion
-        // if total writable size is less than a half of recvbuf_size_, allow buffer expansion
-        bool allow_expand = (writable + readidx_) * 2 < recvbuf_size_;
-        uint32_t extra_size = std::min((uint32_t)sizeof(stackbuf),
-                                       readidx_ + (allow_expand ? Conf::TcpRecvBufMaxSize - recvbuf_size_ : 0));
+        uint32_t writable, extra_size = 0;
+        if(Conf::TcpRecvBufVRing) {
+            // data in [readidx_, writeidx_) is always contiguous as the buffer is mapped twice back to back,
+            // we only need to keep readidx_ in the first mapping
+            if(readidx_ >= recvbuf_size_) {
+                readidx_ -= recvbuf_size_;
+                nextmsg_idx_ -= recvbuf_size_;
+                writeidx_ -= recvbuf_size_;
+            }
+            writable = recvbuf_size_ - (writeidx_ - readidx_);
+        }
+        else {
+            if(readidx_ > 0 && readidx_ == writeidx_) {
+                readidx_ = nextmsg_idx_ = writeidx_ = 0;
+            }
+            writable = recvbuf_size_ - writeidx_;
+            // we should avoid buffer expansion
+            // if total writable size is less than a half of recvbuf_size_, allow buffer expansion
+            bool allow_expand = (writable + readidx_) * 2 < recvbuf_size_;
+            extra_size = std::min((uint32_t)sizeof(stackbuf),
+                                  readidx_ + (allow_expand ? Conf::TcpRecvBufMaxSize - recvbuf_size_ : 0));
+        }
+        recv_would_block_ = false;
         if(writable + extra_size == 0) return 0;
         int ret;
-        if(extra_size == 0){
+        struct iovec vec[2];
+        vec[0].iov_base = &recvbuf_[writeidx_];
+        vec[0].iov_len = writable;
+        vec[1].iov_base = stackbuf;
+        vec[1].iov_len = extra_size;
+        if(uring_) {
+            ret = UringRead(vec, extra_size ? 2 : 1);
+        }
+        else if(extra_size == 0){
             ret = ::read(sockfd_, &recvbuf_[writeidx_], writable);
         }
         else {
-            struct iovec vec[2];
-            vec[0].iov_base = &recvbuf_[writeidx_];
-            vec[0].iov_len = writable;
-            vec[1].iov_base = stackbuf;
-            vec[1].iov_len = extra_size;
             ret = ::readv(sockfd_, vec, 2);
         }
         if(ret <= 0) {
             if(ret < 0) {
                 if(errno == EAGAIN) {
+                    recv_would_block_ = true;
                     if(now_ - recv_time_ > Conf::ConnectionTimeout) {
                         Close("Timeout", 0);
                     }
@@ -333,11 +718,12 @@ private:
             uint32_t newbufsize =
                 std::min(Conf::TcpRecvBufMaxSize, std::max(recvbuf_size_ * 2, (writeidx_ - readidx_ + ret + 7) & -8));
             // std::cout << "expand: " << recvbuf_size_ << " -> " << newbufsize << std::endl;
-            std::unique_ptr<char[]> new_buf(new char[newbufsize]);
+            RecvBuf new_buf(new char[newbufsize]);
             memcpy(&new_buf[0], &recvbuf_[readidx_], recvbuf_size_ - readidx_);
             memcpy(&new_buf[recvbuf_size_ - readidx_], stackbuf, ret - writable);
             recvbuf_size_ = newbufsize;
             std::swap(recvbuf_, new_buf);
+            if(Conf::MemLock && mlock(&recvbuf_[0], recvbuf_size_)) Close("Mlock error", errno);
         }
         writeidx_ -= readidx_; // let caller update writeidx_
         nextmsg_idx_ -= readidx_;
@@ -347,8 +733,17 @@ private:
     }
 
 private:
-    using PTCPQ = PTCPQueue<Conf::TcpQueueSize, Conf::ToLittleEndian>;
+    static const bool Durable = Conf::TcpSyncBatch > 0;
+    static const bool AckPolicy = Conf::TcpAckMsgs || Conf::TcpAckBytes || Conf::TcpAckDelay;
+    static const bool FlushPolicy = Conf::TcpFlushBytes || Conf::TcpFlushDelay || Conf::TcpFlushOnIdle;
+    using PTCPQ = PTCPQueue<Conf::TcpQueueSize, Conf::ToLittleEndian, Durable>;
     PTCPQ* q_ = nullptr; // may be mmaped to file
+    // overflow of q_ when it's full, the segment size is not used if log is disabled
+    // log segments are not synced and its read position could be written back ahead of q_'s synced copy, so msgs
+    // moved out of log would be lost in case of power down
+    static_assert(!Durable || !Conf::TcpLogSegmentSize, "Conf::TcpLogSegmentSize is not supported in durable mode");
+    PTCPLog<Conf::TcpLogSegmentSize ? Conf::TcpLogSegmentSize : sizeof(MsgHeader)> log_;
+    bool alloc_in_log_ = false;
     int sockfd_ = -1;
     int fd_to_close_ = -1;
     const char* close_reason_ = "nil";
@@ -356,7 +751,19 @@ private:
     static_assert(Conf::TcpRecvBufMaxSize >= Conf::TcpRecvBufInitSize, "Conf::TcpRecvBufMaxSize too small");
     static_assert((Conf::TcpRecvBufInitSize % 8) == 0, "Conf::TcpRecvBufInitSize must be a multiple of 8");
     static_assert((Conf::TcpRecvBufMaxSize % 8) == 0, "Conf::TcpRecvBufMaxSize must be a multiple of 8");
-    std::unique_ptr<char[]> recvbuf_;
+    static_assert(!Conf::TcpRecvBufVRing || (Conf::TcpRecvBufMaxSize % 4096) == 0,
+                  "Conf::TcpRecvBufMaxSize must be a multiple of page size for vring");
+    struct RecvBufDeleter
+    {
+        void operator()(char* p) {
+            if(Conf::TcpRecvBufVRing)
+                my_munmap_vring(p, Conf::TcpRecvBufMaxSize);
+            else
+                delete[] p;
+        }
+    };
+    using RecvBuf = std::unique_ptr<char[], RecvBufDeleter>;
+    RecvBuf recvbuf_;
     uint32_t recvbuf_size_ = 0;
     uint32_t writeidx_ = 0;
     uint32_t nextmsg_idx_ = 0;
@@ -364,8 +771,48 @@ private:
     int64_t recv_time_ = 0;
     int64_t send_time_ = 0;
     int64_t now_ = 0;
+    int64_t unsynced_time_ = 0;
+    bool recv_would_block_ = false;
     MsgHeader hbmsg_;
 
+    // for epoll
+    uint64_t* timer_bits_ = nullptr;
+    uint32_t timer_idx_ = 0;
+
+    // for flush policy
+    uint32_t alloc_size_ = 0;      // size of the last msg from Alloc()
+    uint32_t unflushed_bytes_ = 0; // size of msgs from PushMore() not yet sent out
+    int64_t unflushed_time_ = 0;   // when the first of them was pushed
+
+    // for MSG_ZEROCOPY
+    bool zerocopy_ = false;
+    uint32_t zc_sent_ = 0; // number of zerocopy sends
+    uint32_t zc_done_ = 0; // number of completed zerocopy sends
+
+    // for ack policy
+    uint32_t ack_sent_ = 0;       // the latest ack seq remote side has got
+    uint32_t push_ack_ = 0;       // ack seq in the last pushed msg
+    uint32_t consumed_bytes_ = 0; // total size of consumed msgs
+    uint32_t acked_bytes_ = 0;    // consumed_bytes_ when ack_sent_ was updated
+    int64_t unacked_time_ = 0;    // last time all consumed msgs were acked
+    int64_t ack_time_ = 0;        // last time an ack-only frame was sent
+
     uint32_t last_my_ack_ = 0;
+
+    // for io_uring
+    struct UringChunk
+    {
+        uint16_t bid;
+        uint32_t len;
+    };
+    TcpUring* uring_ = nullptr;
+    uint32_t uring_gen_ = 0;      // incremented on each Open
+    uint32_t uring_conn_gen_ = 0; // uring_gen_ of the connection we're receiving for
+    bool uring_armed_ = false;    // if a multishot recv is in flight
+    int uring_err_ = 0;           // -1 for remote close, or errno
+    std::unique_ptr<UringChunk[]> uring_chunks_; // received buffers not yet consumed
+    uint32_t uring_head_ = 0;
+    uint32_t uring_tail_ = 0;
+    uint32_t uring_offset_ = 0; // consumed size of the head buffer
 };
 } // namespace tcpshm
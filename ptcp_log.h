@@ -0,0 +1,201 @@
+/*
+MIT License
+
+Copyright (c) 2018 Meng Rao <raomeng1@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include "msg_header.h"
+#include "mmap.h"
+#include <string>
+
+namespace tcpshm {
+
+// Single thread append-only msg log made of segment files, used as the overflow of ptcp queue
+// When ptcp queue is full(e.g. remote side is away for a long time), new msgs are appended to the log and they're moved
+// into the queue in order once it has free space. Segment files are named <prefix>.<segment no>, only the one being
+// read and the one being written are mmap-ed, and a segment file is unlinked once all its msgs are moved out
+// Msgs are saved in host byte order and ack_seq is not used
+template<uint32_t SegBytes>
+class PTCPLog
+{
+public:
+    static_assert(SegBytes % sizeof(MsgHeader) == 0, "SegBytes must be multiple of 8");
+    static const uint32_t BLK_CNT = SegBytes / sizeof(MsgHeader);
+
+    bool Open(const char* prefix, const char** error_msg) {
+        if(meta_) return true;
+        prefix_ = prefix;
+        meta_ = my_mmap<Meta>((prefix_ + ".log").c_str(), false, error_msg);
+        if(!meta_) return false;
+        rseg_ = Map(meta_->read_seg, error_msg);
+        wseg_ = meta_->read_seg == meta_->write_seg ? rseg_ : Map(meta_->write_seg, error_msg);
+        if(!rseg_ || !wseg_) {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close() {
+        Segment* rseg = rseg_;
+        Segment* wseg = wseg_;
+        rseg_ = wseg_ = nullptr;
+        Release(rseg);
+        if(wseg != rseg) Release(wseg);
+        if(meta_) {
+            my_munmap<Meta>(meta_);
+            meta_ = nullptr;
+        }
+    }
+
+    // remove all msgs and segment files except the one being read
+    void Reset() {
+        for(uint32_t seg = meta_->read_seg + 1; seg != meta_->write_seg + 1; seg++) unlink(SegFile(seg).c_str());
+        Segment* wseg = wseg_;
+        wseg_ = rseg_;
+        Release(wseg);
+        rseg_->write_idx = 0;
+        rseg_->read_pos = 0;
+        meta_->write_seg = meta_->read_seg;
+    }
+
+    // next_seq is the seq the front msg in log will have in ptcp queue
+    // return false if the log doesn't match the queue
+    bool SanityCheck(uint32_t next_seq) {
+        if(rseg_->write_idx > BLK_CNT || (uint32_t)rseg_->read_pos > rseg_->write_idx || wseg_->write_idx > BLK_CNT)
+            return false;
+        if(Empty()) return true;
+        uint32_t read_seq = (uint32_t)(rseg_->read_pos >> 32);
+        // program crashed after the front msg was moved into the queue, but before it's removed from log
+        if(next_seq == read_seq + 1 && Front()) Pop(next_seq);
+        else if(next_seq != read_seq)
+            return false;
+        return true;
+    }
+
+    bool Empty() {
+        uint32_t read_idx = (uint32_t)rseg_->read_pos;
+        if(meta_->read_seg == meta_->write_seg) return read_idx == wseg_->write_idx;
+        // a new segment has just been created for the first msg
+        return meta_->read_seg + 1 == meta_->write_seg && read_idx == rseg_->write_idx && wseg_->write_idx == 0;
+    }
+
+    // return nullptr if failed to create a new segment
+    MsgHeader* Alloc(uint32_t size) {
+        if(size > SegBytes) return nullptr;
+        size += sizeof(MsgHeader);
+        uint32_t blk_sz = (size + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
+        if(blk_sz > BLK_CNT) return nullptr;
+        if(blk_sz > BLK_CNT - wseg_->write_idx) { // roll over to a new segment
+            const char* error_msg;
+            Segment* seg = Map(meta_->write_seg + 1, &error_msg);
+            if(!seg) return nullptr;
+            seg->write_idx = 0; // in case it's a leftover of program crash
+            seg->read_pos = 0;
+            asm volatile("" : : "m"(*seg) :);
+            meta_->write_seg++;
+            Segment* wseg = wseg_;
+            wseg_ = seg;
+            Release(wseg);
+        }
+        MsgHeader& header = wseg_->blk_[wseg_->write_idx];
+        header.SetSize(size);
+        return &header;
+    }
+
+    // next_seq is the seq of this msg in ptcp queue if log is empty
+    void Push(uint32_t next_seq) {
+        if(Empty()) {
+            rseg_->read_pos = ReadPos((uint32_t)rseg_->read_pos, next_seq);
+            asm volatile("" : : "m"(rseg_->read_pos) :);
+        }
+        MsgHeader& header = wseg_->blk_[wseg_->write_idx];
+        wseg_->write_idx += (header.GetSize() + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
+    }
+
+    // precondition: !Empty()
+    // return nullptr if failed to map the next segment
+    MsgHeader* Front() {
+        uint32_t read_idx = (uint32_t)rseg_->read_pos;
+        if(read_idx == rseg_->write_idx) { // all read in this segment, go to the next one
+            const char* error_msg;
+            uint32_t seg_no = meta_->read_seg + 1;
+            Segment* seg = seg_no == meta_->write_seg ? wseg_ : Map(seg_no, &error_msg);
+            if(!seg) return nullptr;
+            seg->read_pos = ReadPos(0, (uint32_t)(rseg_->read_pos >> 32));
+            asm volatile("" : : "m"(seg->read_pos) :);
+            meta_->read_seg = seg_no;
+            Segment* rseg = rseg_;
+            rseg_ = seg;
+            Release(rseg);
+            unlink(SegFile(seg_no - 1).c_str());
+            read_idx = 0;
+        }
+        return &rseg_->blk_[read_idx];
+    }
+
+    // next_seq is the seq of the next msg in ptcp queue after the front msg was moved in
+    void Pop(uint32_t next_seq) {
+        uint32_t read_idx = (uint32_t)rseg_->read_pos;
+        read_idx += (rseg_->blk_[read_idx].GetSize() + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
+        // read index and seq are updated in one store in case of program crash
+        rseg_->read_pos = ReadPos(read_idx, next_seq);
+    }
+
+private:
+    struct Meta
+    {
+        uint32_t read_seg;
+        uint32_t write_seg;
+    };
+
+    struct Segment
+    {
+        uint32_t write_idx;
+        uint32_t pad;
+        uint64_t read_pos; // read index in low 32 bits and the seq of the msg it points to in high 32 bits
+        MsgHeader blk_[BLK_CNT];
+    };
+
+    static uint64_t ReadPos(uint32_t read_idx, uint32_t seq) {
+        return ((uint64_t)seq << 32) | read_idx;
+    }
+
+    std::string SegFile(uint32_t seg_no) {
+        return prefix_ + "." + std::to_string(seg_no);
+    }
+
+    Segment* Map(uint32_t seg_no, const char** error_msg) {
+        return my_mmap<Segment>(SegFile(seg_no).c_str(), false, error_msg);
+    }
+
+    // unmap the segment if it's referred by neither rseg_ nor wseg_
+    void Release(Segment* seg) {
+        if(seg && seg != rseg_ && seg != wseg_) my_munmap<Segment>(seg);
+    }
+
+    std::string prefix_;
+    Meta* meta_ = nullptr;
+    Segment* rseg_ = nullptr;
+    Segment* wseg_ = nullptr;
+};
+} // namespace tcpshm
@@ -25,47 +25,102 @@ SOFTWARE.
 #pragma once
 #include "msg_header.h"
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 namespace tcpshm {
 
+constexpr uint32_t RoundUpPowerOf2(uint32_t n, uint32_t p = 1) {
+    return p >= n ? p : RoundUpPowerOf2(n, p << 1);
+}
+
 // Simple single thread persist Queue that can be mmap-ed to a file
-template<uint32_t Bytes, bool ToLittleEndian>
+// It's a ring buffer of 8 byte blocks, a msg always occupies contiguous blocks, so if there's no enough space at the
+// tail for a new msg, the tail is left unused and the msg is allocated from the head
+// The block index of each msg in queue is recorded by seq_num, so Ack can jump to the new read position directly
+// Queue indexes are protected by a checksum, so on recovery msgs are scanned only if it fails(e.g. program crashed in
+// the middle of updating them)
+// In Durable mode, msgs and ack_seq are not exposed to peer until they're synced to disk by Sync()
+template<uint32_t Bytes, bool ToLittleEndian, bool Durable = false>
 class PTCPQueue
 {
 public:
     static_assert(Bytes % sizeof(MsgHeader) == 0, "Bytes must be multiple of 8");
     static const uint32_t BLK_CNT = Bytes / sizeof(MsgHeader);
+    // a msg occupies at least 1 block, so there can't be more than BLK_CNT msgs in queue
+    static const uint32_t IDX_CNT = RoundUpPowerOf2(BLK_CNT);
 
-    MsgHeader* Alloc(uint16_t size) {
+    MsgHeader* Alloc(uint32_t size) {
+        if(size > Bytes) return nullptr;
         size += sizeof(MsgHeader);
         uint32_t blk_sz = (size + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
-        uint32_t avail_sz = BLK_CNT - write_idx_;
-        if(blk_sz > avail_sz) {
-            if(blk_sz > avail_sz + read_idx_) return nullptr;
-            memmove(blk_, blk_ + read_idx_, (write_idx_ - read_idx_) * sizeof(MsgHeader));
-            write_idx_ -= read_idx_;
-            send_idx_ -= read_idx_;
-            read_idx_ = 0;
+        bool rewind = false;
+        if(write_idx_ < read_idx_) { // wrapped, free space is between write_idx_ and read_idx_
+            // never let write_idx_ catch up read_idx_, otherwise a full queue looks the same as an empty one
+            if(write_idx_ + blk_sz >= read_idx_) return nullptr;
+        }
+        else if(blk_sz > BLK_CNT - write_idx_) { // no enough space at the tail, wrap around
+            if(blk_sz >= read_idx_) return nullptr;
+            rewind = true;
+        }
+        if(Durable && !ReleaseSynced(rewind ? 0 : write_idx_, blk_sz)) return nullptr;
+        if(rewind) {
+            // end_idx_ must be set before write_idx_ in case of program crash
+            end_idx_ = write_idx_;
+            asm volatile("" : : "m"(end_idx_) :);
+            if(send_idx_ == write_idx_) send_idx_ = 0;
+            if(sync_idx_ == write_idx_) sync_idx_ = 0;
+            write_idx_ = 0;
+            UpdateChecksum();
         }
         MsgHeader& header = blk_[write_idx_];
-        header.size = size;
+        header.SetSize(size);
         return &header;
     }
 
     void Push() {
         MsgHeader& header = blk_[write_idx_];
-        uint32_t blk_sz = (header.size + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
-        header.ack_seq = ack_seq_num_;
+        uint32_t blk_sz = (header.GetSize() + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
+        if(header.size != MsgHeader::LARGE_SIZE) header.ack_seq = ack_seq_num_; // a large msg can't carry ack_seq
         header.ConvertByteOrder<ToLittleEndian>();
+        msg_idx_[write_seq_num_ % IDX_CNT] = write_idx_;
+        asm volatile("" : : "m"(blk_) :);
         write_idx_ += blk_sz;
+        write_seq_num_++;
+        UpdateChecksum();
     }
 
-    MsgHeader* GetSendable(int& blk_sz) {
-        blk_sz = write_idx_ - send_idx_;
+    // get blocks not yet sent out, which could be split into 2 segments if the queue is wrapped:
+    // the first one starts at the returned address and the second one starts at the head of the queue
+    MsgHeader* GetSendable(int& blk_sz, int& wrap_blk_sz) {
+        uint32_t end = Durable ? sync_idx_ : write_idx_;
+        if(end < send_idx_) {
+            blk_sz = end_idx_ - send_idx_;
+            wrap_blk_sz = end;
+        }
+        else {
+            blk_sz = end - send_idx_;
+            wrap_blk_sz = 0;
+        }
         return blk_ + send_idx_;
     }
 
+    MsgHeader* GetHead() {
+        return blk_;
+    }
+
     void Sendout(int blk_sz) {
+        uint32_t end = Durable ? sync_idx_ : write_idx_;
+        if(end < send_idx_) {
+            int tail_sz = end_idx_ - send_idx_;
+            if(blk_sz < tail_sz) {
+                send_idx_ += blk_sz;
+                return;
+            }
+            send_idx_ = 0;
+            blk_sz -= tail_sz;
+        }
         send_idx_ += blk_sz;
     }
 
@@ -77,46 +132,208 @@ public:
     // the next seq_num peer side expect
     void Ack(uint32_t ack_seq) {
         if((int)(ack_seq - read_seq_num_) <= 0) return; // if ack_seq is not newer than read_seq_num_
-        // we assume that a successfuly logined client will not attack us
-        // so_seq will never go beyond the msg write_idx_ points to during a connection lifecycle
-        do {
-            read_idx_ +=
-                (Endian<ToLittleEndian>::Convert(blk_[read_idx_].size) + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
-            read_seq_num_++;
-        } while(read_seq_num_ != ack_seq);
-        if(read_idx_ == write_idx_) {
-            read_idx_ = write_idx_ = send_idx_ = 0;
+        if((int)(ack_seq - write_seq_num_) > 0) return; // peer can't ack msgs we haven't written
+        read_idx_ = ack_seq == write_seq_num_ ? write_idx_ : msg_idx_[ack_seq % IDX_CNT];
+        read_seq_num_ = ack_seq;
+        if((int)(read_seq_num_ - sync_seq_num_) > 0) { // no need to sync msgs already consumed by peer
+            sync_idx_ = read_idx_;
+            sync_seq_num_ = read_seq_num_;
+        }
+        if(read_idx_ == write_idx_) { // queue is empty, rewind to the head
+            // keep it a valid(empty) wrapped queue at any point in case of program crash
+            end_idx_ = write_idx_;
+            asm volatile("" : : "m"(end_idx_) :);
+            write_idx_ = send_idx_ = sync_idx_ = 0;
+            asm volatile("" : : "m"(write_idx_) :);
+            read_idx_ = 0;
         }
+        UpdateChecksum();
     }
 
     uint32_t& MyAck() {
         return ack_seq_num_;
     }
 
+    // the ack_seq we can tell peer
+    uint32_t AckToSend() {
+        return Durable ? synced_.ack_seq_num : ack_seq_num_;
+    }
+
+    // the seq_num of the next msg to push
+    uint32_t WriteSeq() {
+        return write_seq_num_;
+    }
+
+    // msgs before this seq_num are persisted on disk by Sync()
+    uint32_t DurableSeq() {
+        return sync_seq_num_;
+    }
+
+    uint32_t UnsyncedCnt() {
+        return write_seq_num_ - sync_seq_num_;
+    }
+
+    bool NeedSync() {
+        return sync_seq_num_ != write_seq_num_ || synced_.ack_seq_num != ack_seq_num_ || !synced_.valid;
+    }
+
+    // write pushed msgs and then a copy of queue indexes to disk, only for queue mmap-ed to a file
+    // in case of power down, the queue is recovered from the copy as OS could have written back the pages in any order
+    // and msgs referred by the copy are never overwritten, see ReleaseSynced()
+    bool Sync() {
+        if(!NeedSync()) return true;
+        uint32_t idx = sync_idx_;
+        if(write_idx_ < idx) { // wrapped since last sync
+            if(idx < end_idx_ && !SyncRange(&blk_[idx], &blk_[end_idx_])) return false;
+            idx = 0;
+        }
+        if(!SyncRange(&blk_[idx], &blk_[write_idx_])) return false;
+        synced_.write_idx = write_idx_;
+        synced_.read_idx = read_idx_;
+        synced_.read_seq_num = read_seq_num_;
+        synced_.ack_seq_num = ack_seq_num_;
+        synced_.end_idx = end_idx_;
+        synced_.write_seq_num = write_seq_num_;
+        synced_.valid = 1;
+        memcpy(synced_.boot_id, BootId(), sizeof(synced_.boot_id));
+        if(!SyncRange(&synced_, &synced_ + 1)) return false;
+        sync_idx_ = write_idx_;
+        sync_seq_num_ = write_seq_num_;
+        return true;
+    }
+
     bool SanityCheckAndGetSeq(uint32_t* seq_start, uint32_t* seq_end) {
-        uint32_t end = read_seq_num_;
-        uint32_t idx = read_idx_;
-        while(idx < write_idx_) {
+        bool restored = false;
+        if(Durable && synced_.valid && memcmp(synced_.boot_id, BootId(), sizeof(synced_.boot_id)) != 0) {
+            // the system has rebooted, maybe due to power down, so recover from the synced copy
+            write_idx_ = synced_.write_idx;
+            read_idx_ = send_idx_ = synced_.read_idx;
+            read_seq_num_ = synced_.read_seq_num;
+            ack_seq_num_ = synced_.ack_seq_num;
+            end_idx_ = synced_.end_idx;
+            restored = true;
+        }
+        if(read_idx_ > BLK_CNT || write_idx_ > BLK_CNT) return false;
+        if(write_idx_ < read_idx_ && end_idx_ > BLK_CNT) return false;
+        if(restored || checksum_ != Checksum() || write_seq_num_ - read_seq_num_ > BLK_CNT) {
+            // indexes are not consistent, scan all msgs to find out write_seq_num_ and rebuild msg_idx_
+            uint32_t end = read_seq_num_;
+            uint32_t idx = read_idx_;
+            if(write_idx_ < read_idx_) { // wrapped, check the segment till end_idx_ first
+                if(!SanityCheckSegment(idx, end_idx_, end)) return false;
+                idx = 0;
+            }
+            if(!SanityCheckSegment(idx, write_idx_, end)) return false;
+            write_seq_num_ = end;
+            UpdateChecksum();
+        }
+        *seq_start = read_seq_num_;
+        *seq_end = write_seq_num_;
+        if(!Durable) return true;
+        // we don't know what was synced before, so treat all msgs as not synced and sync them now
+        // together with current boot id even if the queue is empty
+        sync_idx_ = read_idx_;
+        sync_seq_num_ = read_seq_num_;
+        synced_.valid = 0;
+        return Sync();
+    }
+
+private:
+    uint32_t Checksum() {
+        uint32_t vals[] = {write_idx_, read_idx_, end_idx_, read_seq_num_, write_seq_num_, generation_};
+        uint64_t h = 14695981039346656037ULL; // FNV-1a over 32-bit words
+        for(uint32_t v : vals) h = (h ^ v) * 1099511628211ULL;
+        return (uint32_t)(h ^ (h >> 32));
+    }
+
+    // called after each update of the indexes, a crash before it makes the checksum fail
+    void UpdateChecksum() {
+        generation_++;
+        asm volatile("" : : "m"(generation_) :);
+        checksum_ = Checksum();
+    }
+
+    // a random id generated by kernel on each boot
+    static const char* BootId() {
+        struct Id
+        {
+            char id[40] = {0};
+            Id() {
+                int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+                if(fd < 0) return;
+                if(read(fd, id, sizeof(id) - 1) < 0) id[0] = 0;
+                close(fd);
+            }
+        };
+        static const Id boot_id;
+        return boot_id.id;
+    }
+
+    // msgs acked since last sync are still referred by synced indexes, before overwriting them with a new msg
+    // we need to update synced indexes on disk to exclude them
+    bool ReleaseSynced(uint32_t idx, uint32_t blk_sz) {
+        if(synced_.read_seq_num == read_seq_num_) return true;
+        bool overlap;
+        if(synced_.read_idx <= synced_.write_idx)
+            overlap = idx < synced_.write_idx && synced_.read_idx < idx + blk_sz;
+        else
+            overlap = (idx < synced_.end_idx && synced_.read_idx < idx + blk_sz) || idx < synced_.write_idx;
+        if(!overlap) return true;
+        synced_.read_idx = read_idx_;
+        if((int)(read_seq_num_ - synced_.write_seq_num) >= 0) synced_.write_idx = read_idx_; // all acked
+        synced_.read_seq_num = read_seq_num_;
+        return SyncRange(&synced_, &synced_ + 1);
+    }
+
+    static bool SyncRange(const void* begin, const void* end) {
+        static const uintptr_t page_mask = ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+        if(begin >= end) return true;
+        uintptr_t addr = (uintptr_t)begin & page_mask;
+        return msync((void*)addr, (uintptr_t)end - addr, MS_SYNC) == 0;
+    }
+
+    bool SanityCheckSegment(uint32_t idx, uint32_t end_idx, uint32_t& end) {
+        while(idx < end_idx) {
             MsgHeader header = blk_[idx];
             header.ConvertByteOrder<ToLittleEndian>();
-            if((int)(ack_seq_num_ - header.ack_seq) < 0) return false; // ack_seq in this msg is too new
-            idx += (header.size + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
+            uint32_t size = header.GetSize();
+            // ack_seq in this msg is too new
+            if(header.size != MsgHeader::LARGE_SIZE && (int)(ack_seq_num_ - header.ack_seq) < 0) return false;
+            if(size < sizeof(MsgHeader) || size > Bytes) return false;
+            msg_idx_[end % IDX_CNT] = idx; // rebuild the index as it's not updated with write_idx_ atomically
+            idx += (size + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
             end++;
         }
-        if(idx != write_idx_) return false;
-        *seq_start = read_seq_num_;
-        *seq_end = end;
-        return true;
+        return idx == end_idx;
     }
 
-private:
     MsgHeader blk_[BLK_CNT];
-    // invariant: read_idx_ <= send_idx_ <= write_idx_
-    // where send_idx_ may point to the middle of a msg
+    // if write_idx_ >= read_idx_, msgs are in [read_idx_, write_idx_)
+    // else msgs are in [read_idx_, end_idx_) and [0, write_idx_), we say the queue is wrapped
+    // send_idx_ is between read_idx_ and write_idx_ in the same manner, and it may point to the middle of a msg
     uint32_t write_idx_;
     uint32_t read_idx_;
     uint32_t send_idx_;
     uint32_t read_seq_num_; // the seq_num_ of msg read_idx_ points to
     uint32_t ack_seq_num_;
+    uint32_t end_idx_; // valid only if wrapped
+    uint32_t write_seq_num_; // the seq_num_ of msg write_idx_ points to
+    uint32_t generation_;    // incremented on each update of the indexes
+    uint32_t checksum_;      // of the indexes above and generation_
+    // below are not needed for recovery as they are reset in SanityCheckAndGetSeq
+    uint32_t sync_idx_;      // msgs from sync_idx_ to write_idx_ are not synced to disk
+    uint32_t sync_seq_num_;  // the seq_num_ of msg sync_idx_ points to
+    struct
+    {
+        uint32_t write_idx;
+        uint32_t read_idx;
+        uint32_t read_seq_num;
+        uint32_t ack_seq_num;
+        uint32_t end_idx;
+        uint32_t write_seq_num;
+        uint32_t valid;
+        char boot_id[40];
+    } synced_; // indexes of the queue on disk, updated by Sync()
+    uint32_t msg_idx_[IDX_CNT]; // block index of msgs in queue by seq_num
 };
 } // namespace tcpshm
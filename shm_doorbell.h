@@ -0,0 +1,61 @@
+/*
+MIT License
+
+Copyright (c) 2018 Meng Rao <raomeng1@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include <stdint.h>
+#include <string>
+
+namespace tcpshm {
+
+// A bitmap in shm shared by a group of shm queues with the same reader: a writer sets its bit after pushing msgs,
+// so the reader only needs to check queues whose bits are set instead of touching all of them
+struct ShmDoorbell
+{
+    static const uint32_t MaxBits = 4096;
+    static const uint32_t WordCnt = MaxBits / 64;
+
+    // called by writer after pushing msgs
+    void Ring(uint32_t idx) {
+        uint64_t& word = words[idx / 64];
+        uint64_t mask = 1ULL << (idx % 64);
+        // full fence so that checking the bit is not reordered before pushing msgs, see Take()
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        // don't write the shared cache line if already set
+        if(!(__atomic_load_n(&word, __ATOMIC_RELAXED) & mask)) __atomic_fetch_or(&word, mask, __ATOMIC_RELAXED);
+    }
+
+    // called by reader, take the bits set in the w-th word and clear them, queues must be checked after taking
+    uint64_t Take(uint32_t w) {
+        uint64_t& word = words[w];
+        if(!__atomic_load_n(&word, __ATOMIC_RELAXED)) return 0;
+        return __atomic_exchange_n(&word, 0, __ATOMIC_SEQ_CST);
+    }
+
+    uint64_t words[WordCnt];
+};
+
+inline std::string ShmDoorbellFile(const char* server_name, uint32_t grpid) {
+    return std::string("/") + server_name + "_" + std::to_string(grpid) + ".bell";
+}
+} // namespace tcpshm
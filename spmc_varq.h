@@ -0,0 +1,204 @@
+/*
+MIT License
+
+Copyright (c) 2018 Meng Rao <raomeng1@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include "msg_header.h"
+#include <string.h>
+#include <string>
+
+namespace tcpshm {
+
+// Single producer multiple consumer broadcast queue in shm: every attached reader gets all msgs with its own cursor
+// The writer never waits for readers, a reader falling behind by more than the queue size is overrun: it loses the
+// msgs not read yet and skips to the latest one
+// Readers are attached by name in one of MaxReaders slots, attaching is done on the writer side
+// A slot's cursor is stamped with the attach_seq of its last attach or detach, so a reader never moves the cursor of
+// a slot which has changed since it looked the slot up
+template<uint32_t Bytes, uint32_t BlkSize, uint32_t MaxReaders, uint32_t NameSize>
+class SPMCVarQueue
+{
+public:
+    static_assert(BlkSize >= sizeof(MsgHeader) && BlkSize <= 64 && !(BlkSize & (BlkSize - 1)),
+                  "BlkSize must be 8, 16, 32 or 64");
+    static constexpr uint32_t BLK_CNT = Bytes / BlkSize;
+    static_assert(BLK_CNT && !(BLK_CNT & (BLK_CNT - 1)), "BLK_CNT must be a power of 2");
+    // size of the buffer for Read() in MsgHeader, large enough for any msg size
+    static constexpr uint32_t BUF_CNT = (MsgHeader::LARGE_SIZE + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
+
+    // for writer, allocate a msg which is always contiguous in queue, return nullptr if size is too large
+    // size including header must be less than MsgHeader::LARGE_SIZE
+    MsgHeader* Alloc(uint32_t size) {
+        size += sizeof(MsgHeader);
+        if(size >= MsgHeader::LARGE_SIZE || size > Bytes) return nullptr;
+        uint32_t blk_sz = (size + sizeof(Block) - 1) / sizeof(Block);
+        uint32_t padding_sz = BLK_CNT - (write_idx % BLK_CNT);
+        bool rewind = blk_sz > padding_sz;
+        // blocks before reserve_idx - BLK_CNT are going to be overwritten, tell readers before touching them
+        reserve_idx = write_idx + blk_sz + (rewind ? padding_sz : 0);
+        asm volatile("" : : "m"(reserve_idx) : "memory"); // memory fence
+        alloc_idx = write_idx;
+        if(rewind) {
+            blk[alloc_idx % BLK_CNT].header.size = 0;
+            alloc_idx += padding_sz;
+        }
+        MsgHeader& header = blk[alloc_idx % BLK_CNT].header;
+        header.size = size;
+        return &header;
+    }
+
+    // for writer, publish the msg from Alloc() to all readers
+    void Push() {
+        asm volatile("" : : "m"(blk) : "memory"); // memory fence
+        write_idx = reserve_idx;
+        asm volatile("" : : "m"(write_idx) : ); // force write memory
+    }
+
+    // for writer, attach a reader starting from the next msg, return false if no free slot
+    bool Attach(const char* name) {
+        int slot = FindReader(name);
+        if(slot < 0) {
+            for(slot = 0; slot < (int)MaxReaders && readers[slot].name[0]; slot++)
+                ;
+            if(slot == (int)MaxReaders) return false;
+            strncpy(readers[slot].name, name, NameSize - 1);
+            readers[slot].name[NameSize - 1] = 0;
+        }
+        Stamp(slot, __atomic_load_n(&write_idx, __ATOMIC_ACQUIRE));
+        __atomic_store_n(&attach_seq, attach_seq + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    void Detach(const char* name) {
+        int slot = FindReader(name);
+        if(slot < 0) return;
+        readers[slot].name[0] = 0;
+        Stamp(slot, write_idx);
+        __atomic_store_n(&attach_seq, attach_seq + 1, __ATOMIC_RELEASE);
+    }
+
+    // for writer, detach all readers, e.g. those left in the file by the last run
+    void DetachAll() {
+        for(uint32_t i = 0; i < MaxReaders; i++) {
+            readers[i].name[0] = 0;
+            Stamp(i, write_idx);
+        }
+        __atomic_store_n(&attach_seq, attach_seq + 1, __ATOMIC_RELEASE);
+    }
+
+    // for writer, how many bytes the reader is behind the writer, so slow readers can be detected before overrun
+    // return -1 if not attached
+    int64_t GetLag(const char* name) {
+        int slot = FindReader(name);
+        if(slot < 0) return -1;
+        return (int64_t)(uint32_t)(write_idx - (uint32_t)__atomic_load_n(&readers[slot].cursor, __ATOMIC_RELAXED)) *
+               BlkSize;
+    }
+
+    // for reader, return its slot or -1 if not attached
+    int FindReader(const char* name) {
+        for(uint32_t i = 0; i < MaxReaders; i++) {
+            if(readers[i].name[0] && strncmp(readers[i].name, name, NameSize) == 0) return i;
+        }
+        return -1;
+    }
+
+    // for reader, increased whenever a reader is attached or detached, so reader only needs to find its slot again
+    // after it's changed
+    uint32_t AttachSeq() {
+        return __atomic_load_n(&attach_seq, __ATOMIC_ACQUIRE);
+    }
+
+    // for reader, copy the next msg of the reader in slot to buf, which must be of BUF_CNT MsgHeaders
+    // seq is AttachSeq() before the slot was found, if the slot has changed since then nothing is read
+    // return 1 if got one, 0 if no new msg, or -1 if overrun and it's skipped to the latest msg
+    int Read(uint32_t slot, uint32_t seq, MsgHeader* buf) {
+        uint64_t cursor = __atomic_load_n(&readers[slot].cursor, __ATOMIC_ACQUIRE);
+        if((int)((uint32_t)(cursor >> 32) - seq) > 0) return 0;
+        uint32_t idx = (uint32_t)cursor;
+        while(true) {
+            asm volatile("" : "=m"(write_idx) : :); // force read memory
+            uint32_t end = write_idx;
+            if(idx == end) return 0;
+            asm volatile("" : "=m"(blk) : :); // force read memory
+            uint16_t size = blk[idx % BLK_CNT].header.size;
+            // check after reading size and then content, as the writer sets reserve_idx before overwriting
+            if(Overrun(idx)) return Skip(slot, cursor);
+            if(size == 0) { // rewind
+                idx += BLK_CNT - (idx % BLK_CNT);
+                continue;
+            }
+            // could happen only if queue is corrupt
+            if(size < sizeof(MsgHeader) || size >= MsgHeader::LARGE_SIZE || size > Bytes) return Skip(slot, cursor);
+            memcpy(buf, &blk[idx % BLK_CNT].header, size);
+            if(Overrun(idx)) return Skip(slot, cursor);
+            // the msg is thrown away if the slot is attached or detached meanwhile
+            return Move(slot, cursor, idx + (size + sizeof(Block) - 1) / sizeof(Block)) ? 1 : 0;
+        }
+    }
+
+private:
+    bool Overrun(uint32_t idx) {
+        asm volatile("" : "=m"(reserve_idx) : "m"(blk) :); // memory fence and force read memory
+        return (int)(reserve_idx - idx) > (int)BLK_CNT;
+    }
+
+    int Skip(uint32_t slot, uint64_t cursor) {
+        return Move(slot, cursor, write_idx) ? -1 : 0;
+    }
+
+    // for reader, move the cursor only if it's not stamped since loaded
+    bool Move(uint32_t slot, uint64_t cursor, uint32_t idx) {
+        uint64_t new_cursor = (cursor & ~0xffffffffULL) | idx;
+        return __atomic_compare_exchange_n(
+            &readers[slot].cursor, &cursor, new_cursor, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+
+    // for writer, set the cursor of slot with the attach_seq it's going to publish
+    void Stamp(uint32_t slot, uint32_t idx) {
+        __atomic_store_n(&readers[slot].cursor, (uint64_t)(attach_seq + 1) << 32 | idx, __ATOMIC_RELEASE);
+    }
+
+    struct Block // size of BlkSize
+    {
+        alignas(BlkSize) MsgHeader header;
+    } blk[BLK_CNT];
+
+    // written by writer on every msg, read by all readers
+    alignas(128) uint32_t write_idx = 0;
+    uint32_t reserve_idx = 0;
+    uint32_t attach_seq = 0;
+
+    alignas(128) uint32_t alloc_idx = 0; // used only by writer
+
+    struct alignas(128) Reader
+    {
+        uint64_t cursor; // read_idx in low 32 bits written by reader on every msg, and stamp in high 32 bits
+        char name[NameSize];
+    } readers[MaxReaders];
+};
+
+inline std::string BroadcastFile(const char* server_name, uint32_t ch) {
+    return std::string("/") + server_name + "_" + std::to_string(ch) + ".bcast";
+}
+} // namespace tcpshm
@@ -24,78 +24,175 @@ SOFTWARE.
 
 #pragma once
 #include "msg_header.h"
+#include "futex.h"
 
 namespace tcpshm {
 
-template<uint32_t Bytes>
+// Msgs are allocated in blocks of BlkSize bytes: 64 keeps each msg starting on its own cache line, while smaller
+// ones waste less space for small msgs and fit more msgs in a cache line
+// If Wakeup is true, the reading thread can sleep on an empty queue and Push() will wake it up
+template<uint32_t Bytes, uint32_t BlkSize = 64, bool Wakeup = false>
 class SPSCVarQueue
 {
 public:
-  static constexpr uint32_t BLK_CNT = Bytes / 64;
+  static_assert(BlkSize >= sizeof(MsgHeader) && BlkSize <= 64 && !(BlkSize & (BlkSize - 1)),
+                "BlkSize must be 8, 16, 32 or 64");
+  static constexpr uint32_t BLK_CNT = Bytes / BlkSize;
   static_assert(BLK_CNT && !(BLK_CNT & (BLK_CNT - 1)), "BLK_CNT must be a power of 2");
 
-  MsgHeader* Alloc(uint16_t size) {
+  MsgHeader* Alloc(uint32_t size) {
+    if (size > Bytes) return nullptr;
     size += sizeof(MsgHeader);
     uint32_t blk_sz = (size + sizeof(Block) - 1) / sizeof(Block);
-    uint32_t padding_sz = BLK_CNT - (write_idx % BLK_CNT);
+    uint32_t padding_sz = BLK_CNT - (write_pos % BLK_CNT);
     bool rewind = blk_sz > padding_sz;
     // min_read_idx could be a negtive value which results in a large unsigned int
-    uint32_t min_read_idx = write_idx + blk_sz + (rewind ? padding_sz : 0) - BLK_CNT;
+    uint32_t min_read_idx = write_pos + blk_sz + (rewind ? padding_sz : 0) - BLK_CNT;
     if ((int)(read_idx_cach - min_read_idx) < 0) {
       asm volatile("" : "=m"(read_idx) : :); // force read memory
       read_idx_cach = read_idx;
       if ((int)(read_idx_cach - min_read_idx) < 0) { // no enough space
+        Flush(); // reader can't make room for us if it doesn't see msgs from PushMore()
         return nullptr;
       }
     }
     if (rewind) {
-      blk[write_idx % BLK_CNT].header.size = 0;
-      asm volatile("" : : "m"(blk), "m"(write_idx) :); // memory fence
-      write_idx += padding_sz;
+      blk[write_pos % BLK_CNT].header.size = 0;
+      write_pos += padding_sz;
     }
-    MsgHeader& header = blk[write_idx % BLK_CNT].header;
-    header.size = size;
+    MsgHeader& header = blk[write_pos % BLK_CNT].header;
+    header.SetSize(size);
     return &header;
     }
 
     void Push() {
-        asm volatile("" : : "m"(blk), "m"(write_idx) :); // memory fence
-        uint32_t blk_sz = (blk[write_idx % BLK_CNT].header.size + sizeof(Block) - 1) / sizeof(Block);
-        write_idx += blk_sz;
-        asm volatile("" : : "m"(write_idx) : ); // force write memory
+        PushMore();
+        Flush();
+    }
+
+    // submit the msg from Alloc(), but it's not visible to reader until Flush() or Push()
+    void PushMore() {
+        uint32_t blk_sz = (blk[write_pos % BLK_CNT].header.GetSize() + sizeof(Block) - 1) / sizeof(Block);
+        write_pos += blk_sz;
+    }
+
+    // publish all pushed msgs to reader with one write of write_idx
+    void Flush() {
+        if(write_idx == write_pos) return;
+        if(!Wakeup) {
+            asm volatile("" : : "m"(blk), "m"(write_pos) :); // memory fence
+            write_idx = write_pos;
+            asm volatile("" : : "m"(write_idx) : ); // force write memory
+            return;
+        }
+        // full fence so that checking sleeping is not reordered before writing write_idx, see PrepareWait()
+        __atomic_store_n(&write_idx, write_pos, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&sleeping, 0, __ATOMIC_RELAXED)) {
+            FutexWake(&write_idx);
+        }
     }
 
     MsgHeader* Front() {
-        asm volatile("" : "=m"(write_idx), "=m"(blk) : :); // force read memory
-        if(read_idx == write_idx) {
+        if(!HasMsg(read_idx)) {
             return nullptr;
         }
-        uint16_t size = blk[read_idx % BLK_CNT].header.size;
-        if(size == 0) { // rewind
+        asm volatile("" : "=m"(blk) : :); // force read memory
+        if(blk[read_idx % BLK_CNT].header.size == 0) { // rewind
             read_idx += BLK_CNT - (read_idx % BLK_CNT);
-            if(read_idx == write_idx) {
+            if(!HasMsg(read_idx)) {
                 return nullptr;
             }
+            asm volatile("" : "=m"(blk) : :); // force read memory
         }
-        return &blk[read_idx % BLK_CNT].header;
+        MsgHeader& header = blk[read_idx % BLK_CNT].header;
+        // prefetch the next msg while this one is being handled, but not an unpublished one being written by writer
+        uint32_t next_idx = read_idx + (header.GetSize() + sizeof(Block) - 1) / sizeof(Block);
+        if(next_idx != write_idx_cach) __builtin_prefetch(&blk[next_idx % BLK_CNT]);
+        return &header;
     }
 
     void Pop() {
         asm volatile("" : "=m"(blk) : "m"(read_idx) :); // memory fence
-        uint32_t blk_sz = (blk[read_idx % BLK_CNT].header.size + sizeof(Block) - 1) / sizeof(Block);
+        uint32_t blk_sz = (blk[read_idx % BLK_CNT].header.GetSize() + sizeof(Block) - 1) / sizeof(Block);
         read_idx += blk_sz;
         asm volatile("" : : "m"(read_idx) : ); // force write memory
     }
 
+    // get up to max_cnt msgs from the front, return the number got
+    uint32_t FrontBatch(MsgHeader** headers, uint32_t max_cnt) {
+        asm volatile("" : "=m"(write_idx), "=m"(blk) : :); // force read memory
+        uint32_t end = write_idx_cach = write_idx;
+        uint32_t idx = read_idx;
+        uint32_t cnt = 0;
+        while(cnt < max_cnt && idx != end) {
+            MsgHeader& header = blk[idx % BLK_CNT].header;
+            if(header.size == 0) { // rewind
+                idx += BLK_CNT - (idx % BLK_CNT);
+                continue;
+            }
+            headers[cnt++] = &header;
+            idx += (header.GetSize() + sizeof(Block) - 1) / sizeof(Block);
+        }
+        return cnt;
+    }
+
+    // consume cnt msgs got from FrontBatch(), read_idx is written only once
+    void PopN(uint32_t cnt) {
+        asm volatile("" : "=m"(blk) : "m"(read_idx) :); // memory fence
+        uint32_t idx = read_idx;
+        while(cnt > 0) {
+            MsgHeader& header = blk[idx % BLK_CNT].header;
+            if(header.size == 0) { // rewind
+                idx += BLK_CNT - (idx % BLK_CNT);
+                continue;
+            }
+            idx += (header.GetSize() + sizeof(Block) - 1) / sizeof(Block);
+            cnt--;
+        }
+        read_idx = idx;
+        asm volatile("" : : "m"(read_idx) : ); // force write memory
+    }
+
+    // for the reading thread in Wakeup mode: tell the writer that we're going to sleep on the returned futex word
+    // with the value saved in val, return nullptr if the queue is not empty
+    uint32_t* PrepareWait(uint32_t* val) {
+        __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+        uint32_t idx = __atomic_load_n(&write_idx, __ATOMIC_SEQ_CST);
+        if(idx != read_idx) {
+            CancelWait();
+            return nullptr;
+        }
+        *val = idx;
+        return &write_idx;
+    }
+
+    // called after waking up, or to cancel PrepareWait()
+    void CancelWait() {
+        __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+    }
+
 private:
-  struct Block // size of 64, same as cache line
+    // if there're published msgs from idx, write_idx is read only when msgs known from the last read are exhausted
+    bool HasMsg(uint32_t idx) {
+        if(idx != write_idx_cach) return true;
+        asm volatile("" : "=m"(write_idx) : :); // force read memory
+        write_idx_cach = write_idx;
+        return idx != write_idx_cach;
+    }
+
+  struct Block // size of BlkSize
   {
-    alignas(64) MsgHeader header;
+    alignas(BlkSize) MsgHeader header;
   } blk[BLK_CNT];
 
-  alignas(128) uint32_t write_idx = 0;
-  uint32_t read_idx_cach = 0; // used only by writing thread
+  alignas(128) uint32_t write_idx = 0; // msgs before it are published to reader
+  uint32_t sleeping = 0; // set by reading thread sleeping on write_idx in Wakeup mode
+
+  // used only by writing thread, kept off the cache line of write_idx that reader polls
+  alignas(128) uint32_t write_pos = 0; // msgs before it are pushed
+  uint32_t read_idx_cach = 0;
 
   alignas(128) uint32_t read_idx = 0;
+  uint32_t write_idx_cach = 0; // used only by reading thread
 };
 } // namespace tcpshm
@@ -0,0 +1,187 @@
+/*
+MIT License
+
+Copyright (c) 2018 Meng Rao <raomeng1@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <stdint.h>
+
+namespace tcpshm {
+
+// Edge triggered epoll set for a group of N tcp connections, plus a timer for each of them
+// Connections are identified by id in [0, N). A connection becomes active on an epoll event or when its timer expires,
+// user polls active ones until they would block, then deactivates them with the time they need to be polled again
+// Single thread class except Add()
+template<uint32_t N>
+class TcpEpoll
+{
+public:
+    TcpEpoll() {
+        for(auto& pos : timer_pos_) pos = -1;
+    }
+
+    bool Init() {
+        fd_ = epoll_create1(EPOLL_CLOEXEC);
+        return fd_ >= 0;
+    }
+
+    void Release() {
+        if(fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+        for(uint32_t i = 0; i < N; i++) {
+            active_[i] = false;
+            timer_pos_[i] = -1;
+        }
+        active_cnt_ = timer_cnt_ = 0;
+    }
+
+    bool IsInited() {
+        return fd_ >= 0;
+    }
+
+    // thread safe
+    // sockfd is removed from epoll automatically when it's closed
+    bool Add(int sockfd, uint32_t id) {
+        struct epoll_event ev;
+        // a writable socket reports EPOLLOUT once added, so a new connection is always polled at least once
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.u64 = id;
+        return epoll_ctl(fd_, EPOLL_CTL_ADD, sockfd, &ev) == 0;
+    }
+
+    // activate connections with epoll events or expired timers
+    void Poll(int64_t now) {
+        int n = epoll_wait(fd_, events_, EVENT_CNT, 0);
+        for(int i = 0; i < n; i++) {
+            Activate((uint32_t)events_[i].data.u64);
+        }
+        while(timer_cnt_ > 0 && timer_time_[timer_[0]] <= now) {
+            uint32_t id = timer_[0];
+            RemoveTimer(id);
+            Activate(id);
+        }
+    }
+
+    uint32_t ActiveCnt() {
+        return active_cnt_;
+    }
+
+    uint32_t GetActive(uint32_t i) {
+        return active_list_[i];
+    }
+
+    // deactivate the i-th active connection, the last one is moved to i
+    // it'll be activated again when timer expires at expire_time, or no timer if expire_time < 0
+    void Deactivate(uint32_t i, int64_t expire_time) {
+        uint32_t id = active_list_[i];
+        active_[id] = false;
+        active_list_[i] = active_list_[--active_cnt_];
+        if(expire_time >= 0)
+            SetTimer(id, expire_time);
+        else if(timer_pos_[id] >= 0)
+            RemoveTimer(id);
+    }
+
+    // activate a connection now, e.g. its timer needs to be earlier
+    void Activate(uint32_t id) {
+        if(id >= N || active_[id]) return;
+        active_[id] = true;
+        active_list_[active_cnt_++] = id;
+    }
+
+private:
+
+    // timers are kept in a binary min-heap, timer_pos_ is the position in heap or -1 if not set
+    void SetTimer(uint32_t id, int64_t expire_time) {
+        int pos = timer_pos_[id];
+        if(pos < 0) {
+            pos = timer_cnt_++;
+            timer_[pos] = id;
+            timer_pos_[id] = pos;
+        }
+        int64_t old_time = timer_time_[id];
+        timer_time_[id] = expire_time;
+        if((uint32_t)pos + 1 == timer_cnt_ || expire_time < old_time)
+            SiftUp(pos);
+        else
+            SiftDown(pos);
+    }
+
+    void RemoveTimer(uint32_t id) {
+        int pos = timer_pos_[id];
+        timer_pos_[id] = -1;
+        uint32_t last = timer_[--timer_cnt_];
+        if((uint32_t)pos == timer_cnt_) return;
+        timer_[pos] = last;
+        timer_pos_[last] = pos;
+        SiftUp(pos);
+        SiftDown(timer_pos_[last]);
+    }
+
+    void SiftUp(int pos) {
+        uint32_t id = timer_[pos];
+        while(pos > 0) {
+            int parent = (pos - 1) / 2;
+            if(timer_time_[timer_[parent]] <= timer_time_[id]) break;
+            Place(pos, timer_[parent]);
+            pos = parent;
+        }
+        Place(pos, id);
+    }
+
+    void SiftDown(int pos) {
+        uint32_t id = timer_[pos];
+        while(true) {
+            int child = pos * 2 + 1;
+            if(child >= (int)timer_cnt_) break;
+            if(child + 1 < (int)timer_cnt_ && timer_time_[timer_[child + 1]] < timer_time_[timer_[child]]) child++;
+            if(timer_time_[id] <= timer_time_[timer_[child]]) break;
+            Place(pos, timer_[child]);
+            pos = child;
+        }
+        Place(pos, id);
+    }
+
+    void Place(int pos, uint32_t id) {
+        timer_[pos] = id;
+        timer_pos_[id] = pos;
+    }
+
+    static const int EVENT_CNT = N < 64 ? N : 64;
+
+    int fd_ = -1;
+    struct epoll_event events_[EVENT_CNT];
+
+    uint32_t active_cnt_ = 0;
+    uint32_t active_list_[N];
+    bool active_[N] = {};
+
+    uint32_t timer_cnt_ = 0;
+    uint32_t timer_[N];
+    int timer_pos_[N];
+    int64_t timer_time_[N];
+};
+} // namespace tcpshm
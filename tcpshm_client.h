@@ -25,8 +25,10 @@ SOFTWARE.
 #pragma once
 #include <string>
 #include <array>
+#include <type_traits>
 #include <strings.h>
 #include <sys/socket.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -41,6 +43,7 @@ public:
     using Connection = TcpShmConnection<Conf>;
     using LoginMsg = LoginMsgTpl<Conf>;
     using LoginRspMsg = LoginRspMsgTpl<Conf>;
+    using BroadcastChannel = BroadcastChannelTpl<Conf>;
 
 protected:
     TcpShmClient(const std::string& client_name, const std::string& ptcp_dir)
@@ -61,7 +64,122 @@ protected:
                  const char* server_ipv4,
                  uint16_t server_port,
                  const typename Conf::LoginUserData& login_user_data) {
+        if(!PrepareLogin(use_shm, login_user_data)) return false;
+        int fd = OpenSocket(server_ipv4, server_port, false);
+        if(fd < 0) return false;
+        int ret = send(fd, login_sendbuf_, sizeof(login_sendbuf_), MSG_NOSIGNAL);
+        if(ret != sizeof(login_sendbuf_)) {
+            static_cast<Derived*>(this)->OnSystemError("send", ret < 0 ? errno : 0);
+            close(fd);
+            return false;
+        }
+        ret = recv(fd, login_recvbuf_, sizeof(login_recvbuf_), 0);
+        if(ret != sizeof(login_recvbuf_)) {
+            static_cast<Derived*>(this)->OnSystemError("recv", ret < 0 ? errno : 0);
+            close(fd);
+            return false;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        return HandleLoginRsp(fd);
+    }
+
+    // same as Connect() but never blocks: it only starts connecting, and PollTcp() carries on the login, then
+    // OnLoginSuccess() is called there on success, or one of OnSystemError(), OnLoginReject() and
+    // OnSeqNumberMismatch() on failure, including timeout by Conf::ConnectionTimeout
+    // now is the user provided timestamp as in PollTcp()
+    // return false if failed to start, true if the result is to be reported by PollTcp()
+    bool ConnectAsync(bool use_shm,
+                      const char* server_ipv4,
+                      uint16_t server_port,
+                      const typename Conf::LoginUserData& login_user_data,
+                      int64_t now) {
+        if(!PrepareLogin(use_shm, login_user_data)) return false;
+        login_fd_ = OpenSocket(server_ipv4, server_port, true);
+        if(login_fd_ < 0) return false;
+        login_sent_ = false;
+        login_recv_bytes_ = 0;
+        login_time_ = now;
+        return true;
+    }
+
+    // if ConnectAsync() is in progress
+    bool IsConnecting() {
+        return login_fd_ >= 0;
+    }
+
+    // we need to PollTcp even if using shm
+    void PollTcp(int64_t now) {
+        if(login_fd_ >= 0) PollLogin(now);
         if(!conn_.IsClosed()) {
+            if(Conf::SendStagingSize && !conn_.shm_sendq_) conn_.DrainStaging();
+            MsgHeader* head = conn_.TcpFront(now);
+            if(head) OnMsg(head);
+        }
+        if(conn_.TryCloseFd()) {
+            int sys_errno;
+            const char* reason = conn_.GetCloseReason(&sys_errno);
+            static_cast<Derived*>(this)->OnDisconnected(reason, sys_errno);
+        }
+    }
+
+    // only for using shm
+    // if Conf::ShmWaitSpin > 0, it sleeps for at most Conf::ShmWaitTimeout once the queue is found empty
+    // ShmWaitSpin times in a row
+    void PollShm() {
+        if(Conf::SendStagingSize) conn_.DrainStaging();
+        MsgHeader* head = conn_.ShmFront();
+        if(head) {
+            OnMsg(head);
+            if(Conf::ShmWaitSpin) shm_idle_cnt_ = 0;
+        }
+        else if(Conf::ShmWaitSpin && ++shm_idle_cnt_ >= Conf::ShmWaitSpin) {
+            shm_idle_cnt_ = 0;
+            conn_.ShmWait(Conf::ShmWaitTimeout);
+        }
+    }
+
+    // only for using shm, poll broadcast channel ch(less than Conf::MaxBroadcastChannels) of server
+    // msgs are delivered only if server has attached us to the channel
+    // different channels can be polled by different threads, but each channel by only one thread
+    void PollBroadcast(uint32_t ch) {
+        BroadcastReader& reader = bcast_readers_[ch];
+        if(!reader.q) return;
+        uint32_t attach_seq = reader.q->AttachSeq();
+        if(attach_seq != reader.attach_seq) {
+            reader.attach_seq = attach_seq;
+            reader.slot = reader.q->FindReader(client_name_);
+        }
+        if(reader.slot < 0) return;
+        int ret = reader.q->Read(reader.slot, reader.attach_seq, reader.buf);
+        if(ret > 0)
+            static_cast<Derived*>(this)->OnBroadcastMsg(ch, reader.buf);
+        else if(ret < 0)
+            static_cast<Derived*>(this)->OnBroadcastOverrun(ch);
+    }
+
+    // stop the connection and close files
+    void Stop() {
+        if(login_fd_ >= 0) {
+            close(login_fd_);
+            login_fd_ = -1;
+        }
+        if(server_name_) {
+            my_munmap<ServerName>(server_name_);
+            server_name_ = nullptr;
+        }
+        conn_.Release();
+        ReleaseBroadcast();
+    }
+
+    // get the connection reference which can be kept by user as long as TcpShmClient is not destructed
+    Connection& GetConnection() {
+        return conn_;
+    }
+
+private:
+    // open files and fill login_sendbuf_ for a new login
+    bool PrepareLogin(bool use_shm, const typename Conf::LoginUserData& login_user_data) {
+        if(!conn_.IsClosed() || login_fd_ >= 0) {
             static_cast<Derived*>(this)->OnSystemError("already connected", 0);
             return false;
         }
@@ -76,7 +194,7 @@ protected:
             }
             strncpy(conn_.GetRemoteName(), server_name_, sizeof(ServerName));
         }
-        MsgHeader sendbuf[1 + (sizeof(LoginMsg) + 7) / 8];
+        MsgHeader* sendbuf = login_sendbuf_;
         sendbuf[0].size = sizeof(MsgHeader) + sizeof(LoginMsg);
         sendbuf[0].msg_type = LoginMsg::msg_type;
         sendbuf[0].ack_seq = 0;
@@ -92,31 +210,41 @@ protected:
             static_cast<Derived*>(this)->OnSystemError(error_msg, errno);
             return false;
         }
+        sendbuf[0].template ConvertByteOrder<Conf::ToLittleEndian>();
+        login->ConvertByteOrder();
+        return true;
+    }
+
+    // create a socket connecting to server, for non_blocking the connection could be still in progress
+    // return the fd, or -1 if failed
+    int OpenSocket(const char* server_ipv4, uint16_t server_port, bool non_blocking) {
         int fd;
-        if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        if((fd = socket(AF_INET, SOCK_STREAM | (non_blocking ? SOCK_NONBLOCK : 0), 0)) < 0) {
             static_cast<Derived*>(this)->OnSystemError("socket", errno);
-            return false;
+            return -1;
         }
-        struct timeval timeout;
-        timeout.tv_sec = 10;
-        timeout.tv_usec = 0;
+        if(!non_blocking) {
+            struct timeval timeout;
+            timeout.tv_sec = 10;
+            timeout.tv_usec = 0;
 
-        if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout)) < 0) {
-            static_cast<Derived*>(this)->OnSystemError("setsockopt SO_RCVTIMEO", errno);
-            close(fd);
-            return false;
-        }
+            if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout)) < 0) {
+                static_cast<Derived*>(this)->OnSystemError("setsockopt SO_RCVTIMEO", errno);
+                close(fd);
+                return -1;
+            }
 
-        if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout)) < 0) {
-            static_cast<Derived*>(this)->OnSystemError("setsockopt SO_RCVTIMEO", errno);
-            close(fd);
-            return false;
+            if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout)) < 0) {
+                static_cast<Derived*>(this)->OnSystemError("setsockopt SO_RCVTIMEO", errno);
+                close(fd);
+                return -1;
+            }
         }
         int yes = 1;
         if(Conf::TcpNoDelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) < 0) {
             static_cast<Derived*>(this)->OnSystemError("setsockopt TCP_NODELAY", errno);
             close(fd);
-            return false;
+            return -1;
         }
 
         struct sockaddr_in server_addr;
@@ -125,28 +253,57 @@ protected:
         server_addr.sin_port = htons(server_port);
         bzero(&(server_addr.sin_zero), 8);
 
-        if(connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        if(connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 &&
+           !(non_blocking && errno == EINPROGRESS)) {
             static_cast<Derived*>(this)->OnSystemError("connect", errno);
             close(fd);
-            return false;
+            return -1;
         }
+        return fd;
+    }
 
-        sendbuf[0].template ConvertByteOrder<Conf::ToLittleEndian>();
-        login->ConvertByteOrder();
-        int ret = send(fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL);
-        if(ret != sizeof(sendbuf)) {
-            static_cast<Derived*>(this)->OnSystemError("send", ret < 0 ? errno : 0);
-            close(fd);
-            return false;
+    // carry on the login started by ConnectAsync()
+    void PollLogin(int64_t now) {
+        if(!login_sent_) {
+            struct pollfd pfd = {login_fd_, POLLOUT, 0};
+            int ret = poll(&pfd, 1, 0);
+            if(ret == 0) return CheckLoginTimeout(now);
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if(ret < 0 || getsockopt(login_fd_, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+                return FailLogin("connect", ret < 0 || !err ? errno : err);
+            }
+            ret = send(login_fd_, login_sendbuf_, sizeof(login_sendbuf_), MSG_NOSIGNAL);
+            if(ret != sizeof(login_sendbuf_)) {
+                return FailLogin("send", ret < 0 ? errno : 0);
+            }
+            login_sent_ = true;
         }
+        int ret = recv(login_fd_, (char*)login_recvbuf_ + login_recv_bytes_,
+                       sizeof(login_recvbuf_) - login_recv_bytes_, 0);
+        if(ret < 0 && errno == EAGAIN) return CheckLoginTimeout(now);
+        if(ret <= 0) return FailLogin("recv", ret < 0 ? errno : 0);
+        login_recv_bytes_ += ret;
+        if(login_recv_bytes_ < sizeof(login_recvbuf_)) return CheckLoginTimeout(now);
+        int fd = login_fd_;
+        login_fd_ = -1;
+        HandleLoginRsp(fd);
+    }
 
-        MsgHeader recvbuf[1 + (sizeof(LoginRspMsg) + 7) / 8];
-        ret = recv(fd, recvbuf, sizeof(recvbuf), 0);
-        if(ret != sizeof(recvbuf)) {
-            static_cast<Derived*>(this)->OnSystemError("recv", ret < 0 ? errno : 0);
-            close(fd);
-            return false;
-        }
+    void CheckLoginTimeout(int64_t now) {
+        if(now - login_time_ > Conf::ConnectionTimeout) FailLogin("login timeout", ETIMEDOUT);
+    }
+
+    void FailLogin(const char* error_msg, int sys_errno) {
+        close(login_fd_);
+        login_fd_ = -1;
+        static_cast<Derived*>(this)->OnSystemError(error_msg, sys_errno);
+    }
+
+    // check login_recvbuf_ got from fd, and open the connection if login succeeded, otherwise fd is closed
+    bool HandleLoginRsp(int fd) {
+        const char* error_msg;
+        MsgHeader* recvbuf = login_recvbuf_;
         LoginRspMsg* login_rsp = (LoginRspMsg*)(recvbuf + 1);
         recvbuf[0].template ConvertByteOrder<Conf::ToLittleEndian>();
         login_rsp->ConvertByteOrder();
@@ -156,11 +313,13 @@ protected:
             close(fd);
             return false;
         }
+        LoginMsg* login = (LoginMsg*)(login_sendbuf_ + 1);
+        bool use_shm = login->use_shm;
         if(login_rsp->status != 0) {
             if(login_rsp->status == 1) { // seq number mismatch
-                sendbuf[0].template ConvertByteOrder<Conf::ToLittleEndian>();
+                login_sendbuf_[0].template ConvertByteOrder<Conf::ToLittleEndian>();
                 login->ConvertByteOrder();
-                static_cast<Derived*>(this)->OnSeqNumberMismatch(sendbuf[0].ack_seq,
+                static_cast<Derived*>(this)->OnSeqNumberMismatch(login_sendbuf_[0].ack_seq,
                                                                  login->client_seq_start,
                                                                  login->client_seq_end,
                                                                  recvbuf[0].ack_seq,
@@ -177,6 +336,7 @@ protected:
         // check if server name has changed
         if(strncmp(server_name_, login_rsp->server_name, sizeof(ServerName)) != 0) {
             conn_.Release();
+            ReleaseBroadcast();
             strncpy(server_name_, login_rsp->server_name, sizeof(ServerName));
             strncpy(conn_.GetRemoteName(), server_name_, sizeof(ServerName));
             if(!conn_.OpenFile(use_shm, &error_msg)) {
@@ -186,51 +346,84 @@ protected:
             }
             conn_.Reset();
         }
-        fcntl(fd, F_SETFL, O_NONBLOCK);
+        if(Conf::ShmDoorbell && use_shm &&
+           !conn_.OpenShmDoorbell(login_rsp->GetShmGrpId(), login_rsp->GetShmBellIdx(), &error_msg)) {
+            static_cast<Derived*>(this)->OnSystemError(error_msg, errno);
+            close(fd);
+            return false;
+        }
+        if(Conf::MaxBroadcastChannels && use_shm && !OpenBroadcast(&error_msg)) {
+            static_cast<Derived*>(this)->OnSystemError(error_msg, errno);
+            close(fd);
+            return false;
+        }
         int64_t now = static_cast<Derived*>(this)->OnLoginSuccess(login_rsp);
 
         conn_.Open(fd, recvbuf[0].ack_seq, now);
         return true;
     }
-
-    // we need to PollTcp even if using shm
-    void PollTcp(int64_t now) {
-        if(!conn_.IsClosed()) {
-            MsgHeader* head = conn_.TcpFront(now);
-            if(head) static_cast<Derived*>(this)->OnServerMsg(head);
+    bool OpenBroadcast(const char** error_msg) {
+        for(uint32_t ch = 0; ch < Conf::MaxBroadcastChannels; ch++) {
+            BroadcastReader& reader = bcast_readers_[ch];
+            if(reader.q) continue;
+            std::string bcast_file = BroadcastFile(server_name_, ch);
+            reader.q = my_mmap<BroadcastChannel>(bcast_file.c_str(), true, error_msg, MmapFlags<Conf>());
+            if(!reader.q) return false;
+            reader.attach_seq = reader.q->AttachSeq() - 1; // so our slot is looked up in the first poll
+            reader.slot = -1;
         }
-        if(conn_.TryCloseFd()) {
-            int sys_errno;
-            const char* reason = conn_.GetCloseReason(&sys_errno);
-            static_cast<Derived*>(this)->OnDisconnected(reason, sys_errno);
+        return true;
+    }
+
+    void ReleaseBroadcast() {
+        for(auto& reader : bcast_readers_) {
+            if(reader.q) {
+                my_munmap<BroadcastChannel>(reader.q);
+                reader.q = nullptr;
+            }
         }
     }
 
-    // only for using shm
-    void PollShm() {
-        MsgHeader* head = conn_.ShmFront();
-        if(head) static_cast<Derived*>(this)->OnServerMsg(head);
+    // deliver msgs to user one by one, or in batch if Conf::RecvBatchSize > 0
+    void OnMsg(MsgHeader* head) {
+        OnMsg(head, std::integral_constant<bool, (Conf::RecvBatchSize > 0)>());
     }
 
-    // stop the connection and close files
-    void Stop() {
-        if(server_name_) {
-            my_munmap<ServerName>(server_name_);
-            server_name_ = nullptr;
-        }
-        conn_.Release();
+    void OnMsg(MsgHeader* head, std::false_type) {
+        static_cast<Derived*>(this)->OnServerMsg(head);
     }
 
-    // get the connection reference which can be kept by user as long as TcpShmClient is not destructed
-    Connection& GetConnection() {
-        return conn_;
+    void OnMsg(MsgHeader* head, std::true_type) {
+        MsgHeader* headers[Conf::RecvBatchSize];
+        uint32_t cnt = conn_.FrontBatch(headers, Conf::RecvBatchSize);
+        static_cast<Derived*>(this)->OnServerMsgs(headers, cnt);
     }
 
-private:
     char client_name_[Conf::NameSize];
     using ServerName = std::array<char, Conf::NameSize>;
     char* server_name_ = nullptr;
     std::string ptcp_dir_;
     Connection conn_;
+    uint32_t shm_idle_cnt_ = 0; // used only by PollShm thread
+
+    // for login
+    MsgHeader login_sendbuf_[1 + (sizeof(LoginMsg) + 7) / 8];
+    MsgHeader login_recvbuf_[1 + (sizeof(LoginRspMsg) + 7) / 8];
+    // below are for ConnectAsync()
+    int login_fd_ = -1;
+    bool login_sent_ = false;
+    uint32_t login_recv_bytes_ = 0;
+    int64_t login_time_ = 0;
+
+    struct BroadcastReader
+    {
+        BroadcastChannel* q = nullptr;
+        int slot = -1;
+        uint32_t attach_seq = 0;
+        // a broadcast msg is copied here before delivered, as the writer could overwrite it in queue
+        // one for each channel so channels can be polled by different threads
+        MsgHeader buf[Conf::MaxBroadcastChannels ? BroadcastChannel::BUF_CNT : 1];
+    };
+    BroadcastReader bcast_readers_[Conf::MaxBroadcastChannels ? Conf::MaxBroadcastChannels : 1];
 };
 } // namespace tcpshm
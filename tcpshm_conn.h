@@ -25,10 +25,36 @@ SOFTWARE.
 #pragma once
 #include "ptcp_conn.h"
 #include "spsc_varq.h"
+#include "shm_doorbell.h"
+#include "spmc_varq.h"
+#include "mpsc_varq.h"
 #include "mmap.h"
 
 namespace tcpshm {
 
+// broadcast channel from server to shm clients
+template<class Conf>
+using BroadcastChannelTpl =
+    SPMCVarQueue<Conf::BroadcastQueueSize, Conf::ShmBlockSize, Conf::MaxBroadcastReaders, Conf::NameSize>;
+
+// staging queue of a connection for StageAlloc(), it's empty if Conf::SendStagingSize is 0
+template<uint32_t Bytes>
+struct SendStagingQueue : public MPSCVarQueue<Bytes>
+{};
+
+template<>
+struct SendStagingQueue<0>
+{
+    MsgHeader* Alloc(uint32_t) {
+        return nullptr;
+    }
+    void Push(MsgHeader*) {}
+    MsgHeader* Front() {
+        return nullptr;
+    }
+    void Pop() {}
+};
+
 template<class Conf>
 class TcpShmConnection
 {
@@ -65,28 +91,83 @@ public:
     // allocate a msg of specified size in send queue
     // the returned address is guaranteed to be 8 byte aligned
     // return nullptr if no enough space
-    MsgHeader* Alloc(uint16_t size) {
-        if(shm_sendq_) return shm_sendq_->Alloc(size);
+    // size including header must be less than MsgHeader::LARGE_SIZE unless Conf::LargeMsg is true
+    MsgHeader* Alloc(uint32_t size) {
+        if(!Conf::LargeMsg && size >= MsgHeader::LARGE_SIZE - sizeof(MsgHeader)) return nullptr;
+        if(shm_sendq_) {
+            MsgHeader* header = shm_sendq_->Alloc(size);
+            if(!header) RingShmDoorbell(); // msgs from PushMore() are flushed
+            return header;
+        }
         return ptcp_conn_.Alloc(size);
     }
 
     // submit the last msg from Alloc() and send out
     void Push() {
-        if(shm_sendq_)
+        if(shm_sendq_) {
             shm_sendq_->Push();
+            RingShmDoorbell();
+        }
         else
             ptcp_conn_.Push();
     }
 
-    // for shm, same as Push
-    // for tcp, don't send out immediately as we have more to push
+    // don't send out immediately as we have more to push, msgs are sent with the next Push() or Flush()
+    // for shm, they're also sent if Alloc() fails as the send queue is full
+    // for tcp, they're also sent once it's time to flush by Conf::TcpFlushBytes, or in polling functions by
+    // Conf::TcpFlushDelay or Conf::TcpFlushOnIdle
     void PushMore() {
         if(shm_sendq_)
-            shm_sendq_->Push();
+            shm_sendq_->PushMore();
         else
             ptcp_conn_.PushMore();
     }
 
+    // send out all msgs from PushMore() now
+    void Flush() {
+        if(shm_sendq_) {
+            shm_sendq_->Flush();
+            RingShmDoorbell();
+        }
+        else
+            ptcp_conn_.SendPending();
+    }
+
+    // if Conf::SendStagingSize > 0, allocate a msg in the staging queue of this connection from any thread
+    // it's moved to the send queue by the polling thread of this connection, so it costs one more copy than Alloc()
+    // return nullptr if no enough space, or the msg is larger than half of the send queue
+    MsgHeader* StageAlloc(uint32_t size) {
+        if(!Conf::LargeMsg && size >= MsgHeader::LARGE_SIZE - sizeof(MsgHeader)) return nullptr;
+        // a msg that never fits in the send queue would hold back all staged msgs after it forever
+        if(size > __atomic_load_n(&max_stage_size_, __ATOMIC_ACQUIRE)) return nullptr;
+        return staging_.Alloc(size);
+    }
+
+    // submit a msg from StageAlloc(), it's sent out in the next polling of this connection
+    void StagePush(MsgHeader* header) {
+        staging_.Push(header);
+        MarkStaged();
+    }
+
+    // for tcp in durable mode(Conf::TcpSyncBatch > 0), write all pushed msgs to disk now
+    // return false if failed and the connection will be closed
+    bool Sync() {
+        if(shm_sendq_) return true;
+        return ptcp_conn_.Sync();
+    }
+
+    // for tcp, the seq number of the next msg to push
+    uint32_t GetWriteSeq() {
+        if(shm_sendq_) return 0;
+        return ptcp_conn_.GetWriteSeq();
+    }
+
+    // for tcp, msgs with seq number before the returned one are persisted on disk
+    uint32_t GetDurableSeq() {
+        if(shm_sendq_) return 0;
+        return ptcp_conn_.GetDurableSeq();
+    }
+
     // get the next msg from recv queue, return nullptr if queue is empty
     // the returned address is guaranteed to be 8 byte aligned
     // if caller dont call Pop() later, it will get the same msg again
@@ -104,6 +185,22 @@ public:
             ptcp_conn_.Pop();
     }
 
+    // get up to max_cnt msgs already in recv queue, starting from the one Front() returns, return the number got
+    // for tcp, it doesn't read from network so it should be called after Front() returns a msg
+    // user dont need to call FrontBatch() directly if Conf::RecvBatchSize > 0, as polling functions will do it
+    uint32_t FrontBatch(MsgHeader** headers, uint32_t max_cnt) {
+        if(shm_recvq_) return shm_recvq_->FrontBatch(headers, max_cnt);
+        return ptcp_conn_.FrontBatch(headers, max_cnt);
+    }
+
+    // consume the first cnt msgs we got from FrontBatch() or polling function
+    void PopN(uint32_t cnt) {
+        if(shm_recvq_)
+            shm_recvq_->PopN(cnt);
+        else
+            ptcp_conn_.PopN(cnt);
+    }
+
     typename Conf::ConnectionUserData user_data;
 
 private:
@@ -126,17 +223,45 @@ private:
             std::string shm_send_file = std::string("/") + local_name_ + "_" + remote_name_ + ".shm";
             std::string shm_recv_file = std::string("/") + remote_name_ + "_" + local_name_ + ".shm";
             if(!shm_sendq_) {
-                shm_sendq_ = my_mmap<SHMQ>(shm_send_file.c_str(), true, error_msg);
+                shm_sendq_ = my_mmap<SHMQ>(shm_send_file.c_str(), true, error_msg, MmapFlags<Conf>());
                 if(!shm_sendq_) return false;
             }
             if(!shm_recvq_) {
-                shm_recvq_ = my_mmap<SHMQ>(shm_recv_file.c_str(), true, error_msg);
+                shm_recvq_ = my_mmap<SHMQ>(shm_recv_file.c_str(), true, error_msg, MmapFlags<Conf>());
                 if(!shm_recvq_) return false;
             }
+            __atomic_store_n(&max_stage_size_, ShmMaxStageSize, __ATOMIC_RELEASE);
             return true;
         }
         std::string ptcp_send_file = GetPtcpFile();
-        return ptcp_conn_.OpenFile(ptcp_send_file.c_str(), error_msg);
+        if(!ptcp_conn_.OpenFile(ptcp_send_file.c_str(), error_msg)) return false;
+        __atomic_store_n(&max_stage_size_, TcpMaxStageSize, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // for shm doorbell on client side, map the doorbell of the server group and remember our bit in it
+    bool OpenShmDoorbell(uint32_t grpid, uint32_t bell_idx, const char** error_msg) {
+        if(bell_idx >= ShmDoorbell::MaxBits) {
+            *error_msg = "Invalid shm doorbell";
+            errno = 0;
+            return false;
+        }
+        if(shm_bell_ && grpid != shm_bell_grpid_) {
+            my_munmap<ShmDoorbell>(shm_bell_);
+            shm_bell_ = nullptr;
+        }
+        if(!shm_bell_) {
+            std::string shm_bell_file = ShmDoorbellFile(remote_name_, grpid);
+            shm_bell_ = my_mmap<ShmDoorbell>(shm_bell_file.c_str(), true, error_msg, MmapFlags<Conf>());
+            if(!shm_bell_) return false;
+        }
+        shm_bell_grpid_ = grpid;
+        shm_bell_idx_ = bell_idx;
+        return true;
+    }
+
+    void RingShmDoorbell() {
+        if(Conf::ShmDoorbell && shm_bell_) shm_bell_->Ring(shm_bell_idx_);
     }
 
     bool GetSeq(uint32_t* local_ack_seq, uint32_t* local_seq_start, uint32_t* local_seq_end, const char** error_msg) {
@@ -169,6 +294,10 @@ private:
             my_munmap<SHMQ>(shm_recvq_);
             shm_recvq_ = nullptr;
         }
+        if(shm_bell_) {
+            my_munmap<ShmDoorbell>(shm_bell_);
+            shm_bell_ = nullptr;
+        }
         ptcp_conn_.Release();
     }
 
@@ -182,20 +311,114 @@ private:
 
     MsgHeader* TcpFront(int64_t now) {
         ptcp_conn_.SendHB(now);
-        return ptcp_conn_.Front(); // for shm, we need to recv HB and Front() always return nullptr
+        MsgHeader* head = ptcp_conn_.Front(); // for shm, we need to recv HB and Front() always return nullptr
+        if(!head) ptcp_conn_.OnIdle();
+        return head;
+    }
+
+    // for epoll, whether TcpFront needs to be called again before the socket gets readable or NextTimerTime
+    bool TcpRecvPending() {
+        return !ptcp_conn_.IsClosed() && !ptcp_conn_.RecvWouldBlock();
+    }
+
+    int64_t NextTimerTime() {
+        return ptcp_conn_.NextTimerTime();
+    }
+
+    void Close(const char* reason, int sys_errno) {
+        ptcp_conn_.RequestClose(reason, sys_errno);
+    }
+
+    bool UringPrepare(TcpUring* uring, uint32_t id) {
+        return ptcp_conn_.UringPrepare(uring, id);
+    }
+
+    void UringOnRecv(TcpUring* uring, uint32_t gen, int res, uint32_t flags) {
+        ptcp_conn_.UringOnRecv(uring, gen, res, flags);
+    }
+
+    // for send staging on server side, the bitmap of the group to mark in StagePush() and our bit in it
+    void SetStagedBits(uint64_t* bits, uint32_t idx) {
+        staged_bits_ = bits;
+        staged_idx_ = idx;
+    }
+
+    // for tcp epoll on server side, see PTCPConnection::SetTimerBits()
+    void SetTimerBits(uint64_t* bits, uint32_t idx) {
+        ptcp_conn_.SetTimerBits(bits, idx);
+    }
+
+    // tell the polling thread of the group that this connection may have staged msgs
+    void MarkStaged() {
+        if(!staged_bits_) return;
+        __atomic_fetch_or(&staged_bits_[staged_idx_ / 64], 1ULL << (staged_idx_ % 64), __ATOMIC_RELEASE);
+    }
+
+    // move staged msgs to send queue in order and send them out, called by the polling thread
+    // stop if the send queue is full, and the rest are moved in the next polling
+    // return false if any committed msg is left
+    bool DrainStaging() {
+        MsgHeader* staged = staging_.Front();
+        if(!staged) return true;
+        do {
+            uint32_t size = staged->GetSize() - sizeof(MsgHeader);
+            MsgHeader* header = Alloc(size);
+            if(!header) break;
+            header->msg_type = staged->msg_type;
+            memcpy(header + 1, staged + 1, size);
+            PushMore();
+            staging_.Pop();
+        } while((staged = staging_.Front()));
+        Flush();
+        return !staged;
     }
 
     MsgHeader* ShmFront() {
         return shm_recvq_->Front();
     }
 
+    // set up w for waiting on shm recv queue, return false if the queue is not empty
+    bool ShmPrepareWait(struct futex_waitv& w) {
+        uint32_t val;
+        uint32_t* addr = shm_recvq_->PrepareWait(&val);
+        if(!addr) return false;
+        FutexSetWaiter(w, addr, val);
+        return true;
+    }
+
+    void ShmCancelWait() {
+        shm_recvq_->CancelWait();
+    }
+
+    // sleep until shm recv queue is not empty, for at most timeout_ns
+    void ShmWait(int64_t timeout_ns) {
+        uint32_t val;
+        uint32_t* addr = shm_recvq_->PrepareWait(&val);
+        if(!addr) return;
+        FutexWait(addr, val, timeout_ns);
+        shm_recvq_->CancelWait();
+    }
+
 private:
     const char* local_name_;
     char remote_name_[Conf::NameSize];
     const char* ptcp_dir_ = nullptr;
     PTCPConnection<Conf> ptcp_conn_;
-    using SHMQ = SPSCVarQueue<Conf::ShmQueueSize>;
+    using SHMQ = SPSCVarQueue<Conf::ShmQueueSize, Conf::ShmBlockSize, (Conf::ShmWaitSpin > 0)>;
     alignas(64) SHMQ* shm_sendq_ = nullptr;
     SHMQ* shm_recvq_ = nullptr;
+    ShmDoorbell* shm_bell_ = nullptr; // only used by client
+    uint32_t shm_bell_grpid_ = 0;
+    uint32_t shm_bell_idx_ = 0;
+    // a msg larger than half of the send queue could fail to be allocated even if the queue is empty, depending on
+    // the write position, see Alloc() of the queues
+    static constexpr uint32_t TcpMaxStageSize =
+        Conf::TcpQueueSize / sizeof(MsgHeader) / 2 * sizeof(MsgHeader) - sizeof(MsgHeader);
+    static constexpr uint32_t ShmMaxStageSize = Conf::ShmQueueSize / 2 - sizeof(MsgHeader);
+    // limit of StageAlloc() read by producer threads, set in OpenFile() once it's known which queue is used
+    uint32_t max_stage_size_ = TcpMaxStageSize < ShmMaxStageSize ? TcpMaxStageSize : ShmMaxStageSize;
+    SendStagingQueue<Conf::SendStagingSize> staging_;
+    uint64_t* staged_bits_ = nullptr; // only used by server
+    uint32_t staged_idx_ = 0;
 };
 } // namespace tcpshm
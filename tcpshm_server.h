@@ -23,13 +23,16 @@ SOFTWARE.
 */
 
 #pragma once
+#include <new>
 #include <string>
 #include <strings.h>
+#include <type_traits>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include "tcpshm_conn.h"
+#include "tcp_epoll.h"
 
 namespace tcpshm {
 
@@ -40,6 +43,21 @@ public:
     using Connection = TcpShmConnection<Conf>;
     using LoginMsg = LoginMsgTpl<Conf>;
     using LoginRspMsg = LoginRspMsgTpl<Conf>;
+    using BroadcastChannel = BroadcastChannelTpl<Conf>;
+
+    // connection counts used by Start(), each must be no more than its Conf::Max* counterpart
+    // groups or connections beyond them are not used, so OnNewConnection() should only return grpid less than them
+    struct PoolSize
+    {
+        uint32_t shm_grps = Conf::MaxShmGrps;
+        uint32_t shm_conns_per_grp = Conf::MaxShmConnsPerGrp;
+        uint32_t tcp_grps = Conf::MaxTcpGrps;
+        uint32_t tcp_conns_per_grp = Conf::MaxTcpConnsPerGrp;
+        // only for Conf::RuntimeConnPool, numa node of each group(usually that of its polling thread's cpu)
+        // nullptr or -1 for no preference
+        const int* shm_grp_nodes = nullptr;
+        const int* tcp_grp_nodes = nullptr;
+    };
 
 protected:
     TcpShmServer(const std::string& server_name, const std::string& ptcp_dir)
@@ -47,19 +65,11 @@ protected:
         strncpy(server_name_, server_name.c_str(), sizeof(server_name_) - 1);
         server_name_[sizeof(server_name_) - 1] = 0;
         mkdir(ptcp_dir_.c_str(), 0755);
-        for(auto& conn : conn_pool_) {
-            conn.init(ptcp_dir.c_str(), server_name_);
-        }
-        int cnt = 0;
-        for(auto& grp : shm_grps_) {
-            for(auto& conn : grp.conns) {
-                conn = conn_pool_ + cnt++;
-            }
+        for(auto& fd : listenfds_) {
+            fd = -1;
         }
-        for(auto& grp : tcp_grps_) {
-            for(auto& conn : grp.conns) {
-                conn = conn_pool_ + cnt++;
-            }
+        for(auto& conn : conn_pool_) {
+            conn.init(ptcp_dir_.c_str(), server_name_);
         }
     }
 
@@ -68,91 +78,97 @@ protected:
     }
 
     // start the server
+    // with Conf::RuntimeConnPool, connections are allocated here for pool_size instead of being embedded in server
     // return true if success
-    bool Start(const char* listen_ipv4, uint16_t listen_port) {
-        if(listenfd_ >= 0) {
+    bool Start(const char* listen_ipv4, uint16_t listen_port, const PoolSize& pool_size = PoolSize()) {
+        if(listenfds_[0] >= 0) {
             static_cast<Derived*>(this)->OnSystemError("already started", 0);
             return false;
         }
-
-        if((listenfd_ = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-            static_cast<Derived*>(this)->OnSystemError("socket", errno);
+        if(pool_size.shm_grps > Conf::MaxShmGrps || pool_size.shm_conns_per_grp > Conf::MaxShmConnsPerGrp ||
+           pool_size.tcp_grps > Conf::MaxTcpGrps || pool_size.tcp_conns_per_grp > Conf::MaxTcpConnsPerGrp) {
+            static_cast<Derived*>(this)->OnSystemError("invalid pool size", 0);
             return false;
         }
 
-        fcntl(listenfd_, F_SETFL, O_NONBLOCK);
-        int yes = 1;
-        if(setsockopt(listenfd_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
-            static_cast<Derived*>(this)->OnSystemError("setsockopt SO_REUSEADDR", errno);
-            return false;
+        for(auto& fd : listenfds_) {
+            if(!Listen(fd, listen_ipv4, listen_port)) return false;
         }
-        if(Conf::TcpNoDelay && setsockopt(listenfd_, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) < 0) {
-            static_cast<Derived*>(this)->OnSystemError("setsockopt TCP_NODELAY", errno);
-            return false;
+        if(Conf::ShmDoorbell) {
+            for(uint32_t i = 0; i < Conf::MaxShmGrps; i++) {
+                const char* error_msg;
+                std::string shm_bell_file = ShmDoorbellFile(server_name_, i);
+                shm_bells_[i] = my_mmap<ShmDoorbell>(shm_bell_file.c_str(), true, &error_msg, MmapFlags<Conf>());
+                if(!shm_bells_[i]) {
+                    static_cast<Derived*>(this)->OnSystemError(error_msg, errno);
+                    return false;
+                }
+            }
         }
-
-        struct sockaddr_in local_addr;
-        local_addr.sin_family = AF_INET;
-        inet_pton(AF_INET, listen_ipv4, &(local_addr.sin_addr));
-        local_addr.sin_port = htons(listen_port);
-        bzero(&(local_addr.sin_zero), 8);
-        if(bind(listenfd_, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0) {
-            static_cast<Derived*>(this)->OnSystemError("bind", errno);
-            return false;
+        for(uint32_t ch = 0; ch < Conf::MaxBroadcastChannels; ch++) {
+            const char* error_msg;
+            std::string bcast_file = BroadcastFile(server_name_, ch);
+            bcast_channels_[ch] = my_mmap<BroadcastChannel>(bcast_file.c_str(), true, &error_msg, MmapFlags<Conf>());
+            if(!bcast_channels_[ch]) {
+                static_cast<Derived*>(this)->OnSystemError(error_msg, errno);
+                return false;
+            }
+            // no client is connected yet, readers in the file are from the last run
+            bcast_channels_[ch]->DetachAll();
         }
-        if(listen(listenfd_, 5) < 0) {
-            static_cast<Derived*>(this)->OnSystemError("listen", errno);
-            return false;
+        if(Conf::TcpEpoll) {
+            for(auto& ep : tcp_epolls_) {
+                if(!ep.Init()) {
+                    static_cast<Derived*>(this)->OnSystemError("epoll_create1", errno);
+                    return false;
+                }
+            }
+        }
+        if(Conf::TcpUringBufCnt) {
+            for(auto& uring : tcp_urings_) {
+                const char* error_msg;
+                if(!uring.Init(Conf::TcpUringBufCnt, Conf::TcpUringBufSize, &error_msg)) {
+                    static_cast<Derived*>(this)->OnSystemError(error_msg, errno);
+                    return false;
+                }
+            }
+        }
+        uint32_t offset = 0;
+        for(uint32_t i = 0; i < Conf::MaxShmGrps; i++) {
+            uint32_t size = i < pool_size.shm_grps ? pool_size.shm_conns_per_grp : 0;
+            int node = i < pool_size.shm_grps && pool_size.shm_grp_nodes ? pool_size.shm_grp_nodes[i] : -1;
+            if(!InitGrp(shm_grps_[i], offset, size, node)) return false;
+            offset += Conf::MaxShmConnsPerGrp;
+        }
+        for(uint32_t i = 0; i < Conf::MaxTcpGrps; i++) {
+            uint32_t size = i < pool_size.tcp_grps ? pool_size.tcp_conns_per_grp : 0;
+            int node = i < pool_size.tcp_grps && pool_size.tcp_grp_nodes ? pool_size.tcp_grp_nodes[i] : -1;
+            if(!InitGrp(tcp_grps_[i], offset, size, node)) return false;
+            offset += Conf::MaxTcpConnsPerGrp;
         }
         return true;
     }
 
     // poll control for handling new connections and keep shm connections alive
     void PollCtl(int64_t now) {
-        // every poll we accept only one connection
-        if(avail_idx_ != Conf::MaxNewConnections) {
-            NewConn& conn = new_conns_[avail_idx_];
-            socklen_t addr_len = sizeof(conn.addr);
-            conn.fd = accept(listenfd_, (struct sockaddr*)&(conn.addr), &addr_len);
-            // we ignore errors from accept as most errno should be treated like EAGAIN
-            if(conn.fd >= 0) {
-                fcntl(conn.fd, F_SETFL, O_NONBLOCK);
-                conn.time = now;
-                avail_idx_ = Conf::MaxNewConnections;
-            }
-        }
-        // visit all new connections, trying to read LoginMsg
-        for(int i = 0; i < Conf::MaxNewConnections; i++) {
-            NewConn& conn = new_conns_[i];
-            if(conn.fd < 0) {
-                avail_idx_ = i;
-                continue;
-            }
-            int ret = ::recv(conn.fd, conn.recvbuf, sizeof(conn.recvbuf), 0);
-            if(ret < 0 && errno == EAGAIN && now - conn.time <= Conf::NewConnectionTimeout) {
-                continue;
-            }
-            if(ret == sizeof(conn.recvbuf)) {
-                conn.recvbuf[0].template ConvertByteOrder<Conf::ToLittleEndian>();
-                if(conn.recvbuf[0].size == sizeof(MsgHeader) + sizeof(LoginMsg) &&
-                   conn.recvbuf[0].msg_type == LoginMsg::msg_type) {
-                    // looks like a valid login msg
-                    LoginMsg* login = (LoginMsg*)(conn.recvbuf + 1);
-                    login->ConvertByteOrder();
-                    if(login->use_shm) {
-                        HandleLogin(now, conn, shm_grps_);
-                    }
-                    else {
-                        HandleLogin(now, conn, tcp_grps_);
-                    }
+        if(!Conf::ReusePortListeners) AcceptLogins(now, 0);
+        // handle login msgs got by listeners
+        for(auto& conns : new_conns_) {
+            for(auto& conn : conns) {
+                if(!__atomic_load_n(&conn.login_ready, __ATOMIC_ACQUIRE)) continue;
+                LoginMsg* login = (LoginMsg*)(conn.recvbuf + 1);
+                if(login->use_shm) {
+                    HandleLogin(now, conn, shm_grps_);
                 }
+                else {
+                    HandleLogin(now, conn, tcp_grps_);
+                }
+                if(conn.fd >= 0) {
+                    ::close(conn.fd);
+                    conn.fd = -1;
+                }
+                __atomic_store_n(&conn.login_ready, false, __ATOMIC_RELEASE);
             }
-
-            if(conn.fd >= 0) {
-                ::close(conn.fd);
-                conn.fd = -1;
-            }
-            avail_idx_ = i;
         }
 
         for(auto& grp : shm_grps_) {
@@ -163,7 +179,11 @@ protected:
                     int sys_errno;
                     const char* reason = conn.GetCloseReason(&sys_errno);
                     static_cast<Derived*>(this)->OnClientDisconnected(conn, reason, sys_errno);
-                    std::swap(grp.conns[i], grp.conns[--grp.live_cnt]);
+                    for(uint32_t ch = 0; ch < Conf::MaxBroadcastChannels; ch++) {
+                        bcast_channels_[ch]->Detach(conn.GetRemoteName());
+                    }
+                    grp.Swap(i, --grp.live_cnt);
+                    NotifyShmGrpChange(grp);
                 }
                 else {
                     i++;
@@ -178,7 +198,7 @@ protected:
                     int sys_errno;
                     const char* reason = conn.GetCloseReason(&sys_errno);
                     static_cast<Derived*>(this)->OnClientDisconnected(conn, reason, sys_errno);
-                    std::swap(grp.conns[i], grp.conns[--grp.live_cnt]);
+                    grp.Swap(i, --grp.live_cnt);
                 }
                 else {
                     i++;
@@ -187,57 +207,141 @@ protected:
         }
     }
 
+    // only for Conf::ReusePortListeners > 0, accept new connections of listener id(less than ReusePortListeners) and
+    // read their login msgs, which are then handled by PollCtl()
+    // all listeners must be polled, as kernel spreads new connections among them
+    void PollListener(int64_t now, int id) {
+        AcceptLogins(now, id);
+    }
+
     // poll tcp for serving tcp connections
     void PollTcp(int64_t now, int grpid) {
+        if(Conf::SendStagingSize) DrainStaging(tcp_grps_[grpid]);
+        if(Conf::TcpEpoll) {
+            PollTcpEpoll(now, grpid);
+            return;
+        }
         auto& grp = tcp_grps_[grpid];
         // force read grp.live_cnt from memory, it could have been changed by Ctl thread
         asm volatile("" : "=m"(grp.live_cnt) : :);
+        if(Conf::TcpUringBufCnt) {
+            // dispatch received data to connections and rearm recv for new ones, then they're polled as usual
+            // but reading from io_uring buffers instead of sockets
+            TcpUring& uring = tcp_urings_[grpid];
+            uring.Reap([&](uint64_t user_data, int res, uint32_t flags) {
+                grp.pool[(uint32_t)user_data].UringOnRecv(&uring, user_data >> 32, res, flags);
+            });
+            for(uint32_t i = 0; i < grp.size; i++) { // including closed ones, so they can free buffers
+                Connection* conn = grp.conns[i];
+                if(!conn->UringPrepare(&uring, conn - grp.pool)) break; // submission queue full
+            }
+            uring.Submit(); // errors are seen as transient and it'll be retried in next poll
+        }
         for(int i = 0; i < grp.live_cnt; i++) {
             // it's possible that grp.conns is being swapped by Ctl thread
             // so some live conn could be missed, some closed one could be visited
             // even some conn could be visited twice, but those're all fine
             Connection& conn = *grp.conns[i];
             MsgHeader* head = conn.TcpFront(now);
-            if(head) static_cast<Derived*>(this)->OnClientMsg(conn, head);
+            if(head) OnMsg(conn, head);
         }
     }
 
     // poll shm for serving shm connections
+    // if Conf::ShmWaitSpin > 0, it sleeps for at most Conf::ShmWaitTimeout once all queues in the group are found
+    // empty ShmWaitSpin times in a row
     void PollShm(int grpid) {
         auto& grp = shm_grps_[grpid];
-        asm volatile("" : "=m"(grp.live_cnt) : :);
-        for(int i = 0; i < grp.live_cnt; i++) {
-            Connection& conn = *grp.conns[i];
-            MsgHeader* head = conn.ShmFront();
-            if(head) static_cast<Derived*>(this)->OnClientMsg(conn, head);
+        bool got = false;
+        if(Conf::SendStagingSize) DrainStaging(grp);
+        if(Conf::ShmDoorbell) {
+            got = PollShmDoorbell(grpid);
+        }
+        else {
+            asm volatile("" : "=m"(grp.live_cnt) : :);
+            for(int i = 0; i < grp.live_cnt; i++) {
+                Connection& conn = *grp.conns[i];
+                MsgHeader* head = conn.ShmFront();
+                if(head) {
+                    OnMsg(conn, head);
+                    got = true;
+                }
+            }
         }
+        if(Conf::ShmWaitSpin) {
+            if(got)
+                grp.idle_cnt = 0;
+            else if(++grp.idle_cnt >= Conf::ShmWaitSpin)
+                ShmWait(grp);
+        }
+    }
+
+    // broadcast channel ch(less than Conf::MaxBroadcastChannels) to all attached shm clients
+    // only one thread should Alloc() and Push() msgs on a channel
+    BroadcastChannel& GetBroadcastChannel(uint32_t ch) {
+        return *bcast_channels_[ch];
+    }
+
+    // attach a shm connection to broadcast channel ch, it'll receive msgs pushed afterwards
+    // should be called by CTL thread, e.g. in OnClientLogon(), and conn is detached automatically on disconnection
+    // return false if conn is not using shm or the channel has no free reader slot
+    bool AttachBroadcast(Connection& conn, uint32_t ch) {
+        if(!conn.shm_sendq_) return false;
+        return bcast_channels_[ch]->Attach(conn.GetRemoteName());
+    }
+
+    // should be called by CTL thread
+    void DetachBroadcast(Connection& conn, uint32_t ch) {
+        bcast_channels_[ch]->Detach(conn.GetRemoteName());
+    }
+
+    // how many bytes the client is behind in broadcast channel ch, or -1 if not attached
+    int64_t GetBroadcastLag(Connection& conn, uint32_t ch) {
+        return bcast_channels_[ch]->GetLag(conn.GetRemoteName());
     }
 
     void Stop() {
-        if(listenfd_ < 0) {
+        if(listenfds_[0] < 0) {
             return;
         }
-        ::close(listenfd_);
-        listenfd_ = -1;
-        for(int i = 0; i < Conf::MaxNewConnections; i++) {
-            int& fd = new_conns_[i].fd;
+        for(auto& fd : listenfds_) {
             if(fd >= 0) {
                 ::close(fd);
                 fd = -1;
             }
         }
-        avail_idx_ = 0;
-        for(auto& grp : shm_grps_) {
-            for(auto& conn : grp.conns) {
-                conn->Release();
+        for(auto& conns : new_conns_) {
+            for(auto& conn : conns) {
+                if(conn.fd >= 0) {
+                    ::close(conn.fd);
+                    conn.fd = -1;
+                }
+                conn.login_ready = false;
             }
-            grp.live_cnt = 0;
         }
-        for(auto& grp : tcp_grps_) {
-            for(auto& conn : grp.conns) {
-                conn->Release();
+        for(auto& uring : tcp_urings_) {
+            uring.Release();
+        }
+        for(auto& ep : tcp_epolls_) {
+            ep.Release();
+        }
+        for(auto& bell : shm_bells_) {
+            if(bell) {
+                my_munmap<ShmDoorbell>(bell);
+                bell = nullptr;
+            }
+        }
+        for(auto& bcast : bcast_channels_) {
+            if(bcast) {
+                my_munmap<BroadcastChannel>(bcast);
+                bcast = nullptr;
             }
-            grp.live_cnt = 0;
+        }
+        for(auto& grp : shm_grps_) {
+            ReleaseGrp(grp);
+        }
+        for(auto& grp : tcp_grps_) {
+            ReleaseGrp(grp);
         }
     }
 
@@ -246,6 +350,8 @@ private:
     {
         int64_t time;
         int fd = -1;
+        // set by listener once a login msg is got, and cleared by Ctl thread after handling it
+        bool login_ready = false;
         struct sockaddr_in addr;
         MsgHeader recvbuf[1 + (sizeof(LoginMsg) + 7) / 8];
     };
@@ -254,8 +360,315 @@ private:
     {
         uint32_t live_cnt = 0;
         Connection* conns[N];
+        // for shm waiter mode
+        uint32_t idle_cnt = 0;   // used only by polling thread
+        uint32_t change_seq = 0; // increased by Ctl thread when conns is changed
+        // for shm doorbell, bits taken from doorbell and not yet found empty, used only by polling thread
+        uint64_t bell_pending[(N + 63) / 64] = {};
+        // for send staging, bits of connections that may have staged msgs, set by any thread in StagePush()
+        alignas(64) uint64_t staged[(N + 63) / 64] = {};
+        // for tcp epoll, bits of connections whose timer could be earlier than the one set in epoll
+        uint64_t timer_dirty[(N + 63) / 64] = {};
+
+        // the group's connections, a slot is an index in it
+        // it's a range of conn_pool_, or allocated in Start() for Conf::RuntimeConnPool
+        Connection* pool = nullptr;
+        uint32_t size = 0; // number of connections, conns beyond it are not used
+
+        // below are used only by Ctl thread
+        // index in conns of each slot
+        uint32_t conn_idx[N];
+        // slots from 0 to used_cnt are assigned to client names, and kept until Stop()
+        uint32_t used_cnt = 0;
+        // open addressing hash index from client name to slot + 1, 0 for empty entry
+        // slots are never unassigned one by one so there's no deletion
+        static constexpr uint32_t NAME_INDEX_SIZE = RoundUpPowerOf2(N * 2);
+        uint32_t name_index[NAME_INDEX_SIZE] = {};
+
+        void Init(Connection* p, uint32_t sz) {
+            pool = p;
+            size = sz;
+            for(uint32_t i = 0; i < size; i++) {
+                conns[i] = pool + i;
+                conn_idx[i] = i;
+                if(Conf::SendStagingSize) pool[i].SetStagedBits(staged, i);
+                if(Conf::TcpEpoll) pool[i].SetTimerBits(timer_dirty, i);
+            }
+        }
+
+        void Swap(uint32_t i, uint32_t j) {
+            std::swap(conns[i], conns[j]);
+            conn_idx[conns[i] - pool] = i;
+            conn_idx[conns[j] - pool] = j;
+        }
+
+        // find the connection of the client name, or assign a free one to it
+        // return nullptr if all are assigned
+        Connection* FindConn(const char* name) {
+            uint32_t mask = NAME_INDEX_SIZE - 1;
+            for(uint32_t h = HashName(name) & mask;; h = (h + 1) & mask) {
+                uint32_t v = name_index[h];
+                if(v == 0) { // not found
+                    if(used_cnt == size) return nullptr;
+                    Connection* conn = pool + used_cnt++;
+                    strncpy(conn->GetRemoteName(), name, Conf::NameSize);
+                    name_index[h] = conn - pool + 1;
+                    return conn;
+                }
+                Connection* conn = pool + v - 1;
+                if(strncmp(conn->GetRemoteName(), name, Conf::NameSize) == 0) return conn;
+            }
+        }
+
+        // FNV-1a
+        static uint32_t HashName(const char* name) {
+            uint32_t h = 2166136261u;
+            for(uint32_t i = 0; i < Conf::NameSize && name[i]; i++) {
+                h = (h ^ (uint8_t)name[i]) * 16777619u;
+            }
+            return h;
+        }
+
+        void ClearNames() {
+            used_cnt = 0;
+            memset(name_index, 0, sizeof(name_index));
+        }
     };
 
+    // sleep until any shm queue in the group is not empty or the group is changed, or timeout
+    void ShmWait(ConnectionGroup<Conf::MaxShmConnsPerGrp>& grp) {
+        grp.idle_cnt = 0;
+        struct futex_waitv waiters[Conf::MaxShmConnsPerGrp + 1];
+        // change_seq is read before conns, so a change after it is seen by futex
+        FutexSetWaiter(waiters[0], &grp.change_seq, __atomic_load_n(&grp.change_seq, __ATOMIC_ACQUIRE), true);
+        uint32_t live_cnt = __atomic_load_n(&grp.live_cnt, __ATOMIC_ACQUIRE);
+        uint32_t cnt = 0;
+        while(cnt < live_cnt && grp.conns[cnt]->ShmPrepareWait(waiters[cnt + 1])) cnt++;
+        if(cnt == live_cnt) FutexWaitv(waiters, cnt + 1, Conf::ShmWaitTimeout);
+        for(uint32_t i = 0; i < cnt; i++) grp.conns[i]->ShmCancelWait();
+    }
+
+    // only poll connections whose doorbell bits are set, a bit is kept pending until its queue is found empty
+    // return true if got any msg
+    bool PollShmDoorbell(int grpid) {
+        ShmDoorbell* bell = shm_bells_[grpid];
+        uint64_t* pending = shm_grps_[grpid].bell_pending;
+        Connection* conns = ShmGrpConns(grpid);
+        bool got = false;
+        for(uint32_t w = 0; w < (Conf::MaxShmConnsPerGrp + 63) / 64; w++) {
+            pending[w] |= bell->Take(w);
+            for(uint64_t bits = pending[w]; bits; bits &= bits - 1) {
+                uint32_t bit = __builtin_ctzll(bits);
+                uint32_t idx = w * 64 + bit;
+                // closed connections are skipped, their bits are set again on login
+                MsgHeader* head = nullptr;
+                if(idx < shm_grps_[grpid].size && !conns[idx].IsClosed()) head = conns[idx].ShmFront();
+                if(head) {
+                    OnMsg(conns[idx], head);
+                    got = true;
+                }
+                else {
+                    pending[w] &= ~(1ULL << bit);
+                }
+            }
+        }
+        return got;
+    }
+
+    // move msgs staged by other threads to send queues, only connections marked in StagePush() are checked
+    // closed connections are skipped, they're marked again on login
+    template<uint32_t N>
+    void DrainStaging(ConnectionGroup<N>& grp) {
+        for(uint32_t w = 0; w < (N + 63) / 64; w++) {
+            if(!__atomic_load_n(&grp.staged[w], __ATOMIC_RELAXED)) continue;
+            uint64_t left = 0;
+            for(uint64_t bits = __atomic_exchange_n(&grp.staged[w], 0, __ATOMIC_ACQUIRE); bits; bits &= bits - 1) {
+                uint32_t bit = __builtin_ctzll(bits);
+                Connection& conn = grp.pool[w * 64 + bit];
+                if(!conn.IsClosed() && !conn.DrainStaging()) left |= 1ULL << bit; // send queue is full
+            }
+            if(left) __atomic_fetch_or(&grp.staged[w], left, __ATOMIC_RELAXED);
+        }
+    }
+
+    // wake up the polling thread of a shm group sleeping in ShmWait()
+    void NotifyShmGrpChange(ConnectionGroup<Conf::MaxShmConnsPerGrp>& grp) {
+        if(!Conf::ShmWaitSpin) return;
+        __atomic_fetch_add(&grp.change_seq, 1, __ATOMIC_RELEASE);
+        FutexWake(&grp.change_seq, true);
+    }
+
+    // only connections with epoll events, expired timers or msgs pushed to while waiting are polled, others cost
+    // nothing
+    void PollTcpEpoll(int64_t now, int grpid) {
+        auto& ep = tcp_epolls_[grpid];
+        auto& grp = tcp_grps_[grpid];
+        Connection* conns = TcpGrpConns(grpid);
+        ep.Poll(now);
+        // their timers are set again when they're deactivated
+        for(uint32_t w = 0; w < (Conf::MaxTcpConnsPerGrp + 63) / 64; w++) {
+            if(!__atomic_load_n(&grp.timer_dirty[w], __ATOMIC_RELAXED)) continue;
+            for(uint64_t bits = __atomic_exchange_n(&grp.timer_dirty[w], 0, __ATOMIC_ACQUIRE); bits; bits &= bits - 1) {
+                ep.Activate(w * 64 + __builtin_ctzll(bits));
+            }
+        }
+        for(uint32_t i = 0; i < ep.ActiveCnt();) {
+            Connection& conn = conns[ep.GetActive(i)];
+            MsgHeader* head = conn.TcpFront(now);
+            if(head) OnMsg(conn, head);
+            // with edge triggered epoll, keep polling it until there's nothing more to read
+            if(head || conn.TcpRecvPending()) {
+                i++;
+                continue;
+            }
+            ep.Deactivate(i, conn.IsClosed() ? -1 : conn.NextTimerTime());
+        }
+    }
+
+    // deliver msgs to user one by one, or in batch if Conf::RecvBatchSize > 0
+    void OnMsg(Connection& conn, MsgHeader* head) {
+        OnMsg(conn, head, std::integral_constant<bool, (Conf::RecvBatchSize > 0)>());
+    }
+
+    void OnMsg(Connection& conn, MsgHeader* head, std::false_type) {
+        static_cast<Derived*>(this)->OnClientMsg(conn, head);
+    }
+
+    void OnMsg(Connection& conn, MsgHeader* head, std::true_type) {
+        MsgHeader* headers[Conf::RecvBatchSize];
+        uint32_t cnt = conn.FrontBatch(headers, Conf::RecvBatchSize);
+        static_cast<Derived*>(this)->OnClientMsgs(conn, headers, cnt);
+    }
+
+    // connections of a shm group are at fixed slots, the slot is the doorbell bit
+    Connection* ShmGrpConns(int grpid) {
+        return shm_grps_[grpid].pool;
+    }
+
+    // connections of a tcp group are at fixed slots, though their order in grp.conns changes
+    Connection* TcpGrpConns(int grpid) {
+        return tcp_grps_[grpid].pool;
+    }
+
+    // set up a group of size connections from conn_pool_ at offset, or allocate them in a separate memory on numa_node
+    // for Conf::RuntimeConnPool
+    template<uint32_t N>
+    bool InitGrp(ConnectionGroup<N>& grp, uint32_t offset, uint32_t size, int numa_node) {
+        Connection* pool = nullptr;
+        if(!Conf::RuntimeConnPool) {
+            pool = conn_pool_ + offset;
+        }
+        else {
+            if(size) {
+                const char* error_msg;
+                pool = (Connection*)my_mmap_arena(ArenaBytes(size), numa_node, &error_msg, MmapFlags<Conf>());
+                if(!pool) {
+                    static_cast<Derived*>(this)->OnSystemError(error_msg, errno);
+                    return false;
+                }
+                for(uint32_t i = 0; i < size; i++) {
+                    new(pool + i) Connection();
+                    pool[i].init(ptcp_dir_.c_str(), server_name_);
+                }
+            }
+        }
+        grp.Init(pool, size);
+        return true;
+    }
+
+    template<uint32_t N>
+    void ReleaseGrp(ConnectionGroup<N>& grp) {
+        for(uint32_t i = 0; i < grp.size; i++) {
+            grp.conns[i]->Release();
+        }
+        grp.live_cnt = 0;
+        grp.ClearNames();
+        if(Conf::RuntimeConnPool && grp.pool) {
+            for(uint32_t i = 0; i < grp.size; i++) {
+                grp.pool[i].~Connection();
+            }
+            my_munmap_arena(grp.pool, ArenaBytes(grp.size));
+        }
+        grp.Init(Conf::RuntimeConnPool ? nullptr : grp.pool, 0);
+    }
+
+    static size_t ArenaBytes(uint32_t size) {
+        return sizeof(Connection) * size;
+    }
+
+    bool Listen(int& fd, const char* listen_ipv4, uint16_t listen_port) {
+        if((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+            static_cast<Derived*>(this)->OnSystemError("socket", errno);
+            return false;
+        }
+
+        int yes = 1;
+        if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
+            static_cast<Derived*>(this)->OnSystemError("setsockopt SO_REUSEADDR", errno);
+            return false;
+        }
+        if(Conf::ReusePortListeners && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0) {
+            static_cast<Derived*>(this)->OnSystemError("setsockopt SO_REUSEPORT", errno);
+            return false;
+        }
+        if(Conf::TcpNoDelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) < 0) {
+            static_cast<Derived*>(this)->OnSystemError("setsockopt TCP_NODELAY", errno);
+            return false;
+        }
+
+        struct sockaddr_in local_addr;
+        local_addr.sin_family = AF_INET;
+        inet_pton(AF_INET, listen_ipv4, &(local_addr.sin_addr));
+        local_addr.sin_port = htons(listen_port);
+        bzero(&(local_addr.sin_zero), 8);
+        if(bind(fd, (struct sockaddr*)&local_addr, sizeof(local_addr)) < 0) {
+            static_cast<Derived*>(this)->OnSystemError("bind", errno);
+            return false;
+        }
+        if(listen(fd, Conf::ListenBacklog) < 0) {
+            static_cast<Derived*>(this)->OnSystemError("listen", errno);
+            return false;
+        }
+        return true;
+    }
+
+    // accept new connections into free slots until the accept queue is drained, and try to read LoginMsg from them
+    // slots with a login msg are left for PollCtl() to handle
+    void AcceptLogins(int64_t now, int id) {
+        bool can_accept = true;
+        for(auto& conn : new_conns_[id]) {
+            if(__atomic_load_n(&conn.login_ready, __ATOMIC_ACQUIRE)) continue;
+            if(conn.fd < 0) {
+                if(!can_accept) continue;
+                socklen_t addr_len = sizeof(conn.addr);
+                conn.fd = accept4(listenfds_[id], (struct sockaddr*)&(conn.addr), &addr_len, SOCK_NONBLOCK);
+                // we ignore errors from accept as most errno should be treated like EAGAIN
+                if(conn.fd < 0) {
+                    can_accept = false;
+                    continue;
+                }
+                conn.time = now;
+            }
+            int ret = ::recv(conn.fd, conn.recvbuf, sizeof(conn.recvbuf), 0);
+            if(ret < 0 && errno == EAGAIN && now - conn.time <= Conf::NewConnectionTimeout) {
+                continue;
+            }
+            if(ret == sizeof(conn.recvbuf)) {
+                conn.recvbuf[0].template ConvertByteOrder<Conf::ToLittleEndian>();
+                if(conn.recvbuf[0].size == sizeof(MsgHeader) + sizeof(LoginMsg) &&
+                   conn.recvbuf[0].msg_type == LoginMsg::msg_type) {
+                    // looks like a valid login msg
+                    LoginMsg* login = (LoginMsg*)(conn.recvbuf + 1);
+                    login->ConvertByteOrder();
+                    __atomic_store_n(&conn.login_ready, true, __ATOMIC_RELEASE);
+                    continue;
+                }
+            }
+            ::close(conn.fd);
+            conn.fd = -1;
+        }
+    }
+
     template<uint32_t N>
     void HandleLogin(int64_t now, NewConn& conn, ConnectionGroup<N>* grps) {
         MsgHeader sendbuf[1 + (sizeof(LoginRspMsg) + 7) / 8];
@@ -283,17 +696,10 @@ private:
             return;
         }
         auto& grp = grps[grpid];
-        for(int i = 0; i < N; i++) {
-            Connection& curconn = *grp.conns[i];
-            char* remote_name = curconn.GetRemoteName();
-            if(remote_name[0] == 0) { // found an unused one, use it then
-                strncpy(remote_name, login->client_name, sizeof(login->client_name));
-            }
-            if(strncmp(remote_name, login->client_name, sizeof(login->client_name)) != 0) {
-                // client name does not match
-                continue;
-            }
-            // match
+        Connection* found = grp.FindConn(login->client_name);
+        if(found) {
+            Connection& curconn = *found;
+            uint32_t i = grp.conn_idx[found - grp.pool];
             if(i < grp.live_cnt) {
                 strncpy(login_rsp->error_msg, "Already loggned on", sizeof(login_rsp->error_msg));
                 ::send(conn.fd, sendbuf, sizeof(sendbuf), MSG_NOSIGNAL);
@@ -330,6 +736,10 @@ private:
             sendbuf[0].ack_seq = Endian<Conf::ToLittleEndian>::Convert(local_ack_seq);
             login_rsp->server_seq_start = local_seq_start;
             login_rsp->server_seq_end = local_seq_end;
+            if(login->use_shm)
+                login_rsp->SetShmBell(grpid, &curconn - ShmGrpConns(grpid));
+            else
+                login_rsp->SetShmBell(0, 0);
             login_rsp->ConvertByteOrder();
             if(!CheckAckInQueue(remote_ack_seq, local_seq_start, local_seq_end) ||
                !CheckAckInQueue(local_ack_seq, remote_seq_start, remote_seq_end)) {
@@ -351,9 +761,21 @@ private:
                 return;
             }
             curconn.Open(conn.fd, remote_ack_seq, now);
+            // register after Open, so the first event would see an open connection
+            if(Conf::TcpEpoll && !login->use_shm &&
+               !tcp_epolls_[grpid].Add(conn.fd, &curconn - TcpGrpConns(grpid))) {
+                curconn.Close("Epoll error", errno);
+            }
             conn.fd = -1; // so it won't be closed by caller
             // switch to live
-            std::swap(grp.conns[i], grp.conns[grp.live_cnt++]);
+            grp.Swap(i, grp.live_cnt++);
+            // msgs staged when it's closed are not drained
+            if(Conf::SendStagingSize) curconn.MarkStaged();
+            if(login->use_shm) {
+                // msgs pushed when it's closed are not notified
+                if(Conf::ShmDoorbell) shm_bells_[grpid]->Ring(&curconn - ShmGrpConns(grpid));
+                NotifyShmGrpChange(shm_grps_[grpid]);
+            }
             static_cast<Derived*>(this)->OnClientLogon(conn.addr, curconn);
             return;
         }
@@ -370,13 +792,24 @@ private:
 private:
     char server_name_[Conf::NameSize];
     std::string ptcp_dir_;
-    int listenfd_ = -1;
-
-    NewConn new_conns_[Conf::MaxNewConnections];
-    int avail_idx_ = 0;
+    static const uint32_t ListenerCnt = Conf::ReusePortListeners ? Conf::ReusePortListeners : 1;
+    int listenfds_[ListenerCnt];
+    NewConn new_conns_[ListenerCnt][Conf::MaxNewConnections];
 
-    Connection conn_pool_[Conf::MaxShmConnsPerGrp * Conf::MaxShmGrps + Conf::MaxTcpConnsPerGrp * Conf::MaxTcpGrps];
+    // not used for Conf::RuntimeConnPool
+    Connection conn_pool_[Conf::RuntimeConnPool
+                              ? 1
+                              : Conf::MaxShmConnsPerGrp * Conf::MaxShmGrps + Conf::MaxTcpConnsPerGrp * Conf::MaxTcpGrps];
     ConnectionGroup<Conf::MaxShmConnsPerGrp> shm_grps_[Conf::MaxShmGrps];
     ConnectionGroup<Conf::MaxTcpConnsPerGrp> tcp_grps_[Conf::MaxTcpGrps];
+    TcpUring tcp_urings_[Conf::MaxTcpGrps];
+    static_assert(!Conf::ShmDoorbell || Conf::MaxShmConnsPerGrp <= ShmDoorbell::MaxBits,
+                  "Conf::MaxShmConnsPerGrp must be no more than ShmDoorbell::MaxBits with shm doorbell");
+    ShmDoorbell* shm_bells_[Conf::MaxShmGrps] = {};
+    BroadcastChannel* bcast_channels_[Conf::MaxBroadcastChannels ? Conf::MaxBroadcastChannels : 1] = {};
+    static_assert(!Conf::ShmWaitSpin || Conf::MaxShmConnsPerGrp < FUTEX_WAITV_MAX,
+                  "Conf::MaxShmConnsPerGrp must be less than FUTEX_WAITV_MAX in shm waiter mode");
+    static_assert(!Conf::TcpEpoll || !Conf::TcpUringBufCnt, "Conf::TcpEpoll and io_uring can't be both enabled");
+    TcpEpoll<Conf::TcpEpoll ? Conf::MaxTcpConnsPerGrp : 1> tcp_epolls_[Conf::MaxTcpGrps];
 };
 } // namespace tcpshm
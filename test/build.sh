@@ -1,2 +1,4 @@
 g++ -std=c++11 -O3 -o echo_server echo_server.cc -lrt -lpthread
 g++ -std=c++11 -O3 -o echo_client echo_client.cc -lrt -lpthread
+g++ -std=c++11 -O3 -o shmq_bench shmq_bench.cc -lrt -lpthread
+g++ -std=c++11 -O3 -o epoll_flush_test epoll_flush_test.cc -lrt -lpthread
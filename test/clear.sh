@@ -4,4 +4,5 @@ rm -rf c1
 rm -rf c2
 rm -rf c3
 rm -rf server
+rm -rf epoll_flush_ptcp
 rm -f /dev/shm/*
@@ -5,7 +5,14 @@ struct CommonConf
 {
     static const uint32_t NameSize = 16;
     static const uint32_t ShmQueueSize = 1024 * 1024; // must be power of 2
+    static const uint32_t ShmBlockSize = 64;          // 8, 16, 32 or 64
     static const bool ToLittleEndian = true; // set to the endian of majority of the hosts
+    static const bool LargeMsg = false;      // if allow msgs not fitting in uint16_t
+    static const uint32_t ShmWaitSpin = 0;   // 0 to disable shm waiter mode
+    static const bool ShmDoorbell = false;
+    static const uint32_t MaxBroadcastChannels = 0;         // 0 to disable broadcast
+    static const uint32_t BroadcastQueueSize = 1024 * 1024; // must be power of 2
+    static const uint32_t MaxBroadcastReaders = 8;
 
     using LoginUserData = char;
     using LoginRspUserData = char;
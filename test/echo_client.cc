@@ -14,10 +14,28 @@ struct ClientConf : public CommonConf
   static const uint32_t TcpQueueSize = 2000;       // must be a multiple of 8
   static const uint32_t TcpRecvBufInitSize = 1000; // must be a multiple of 8
   static const uint32_t TcpRecvBufMaxSize = 2000;  // must be a multiple of 8
+  static const bool TcpRecvBufVRing = false;       // if true, TcpRecvBufMaxSize must be a multiple of 4096
   static const bool TcpNoDelay = true;
+  static const uint32_t TcpSyncBatch = 0;          // 0 to disable durable mode
+  static const int64_t TcpSyncInterval = NanoInSecond / 1000;
+  static const uint32_t TcpLogSegmentSize = 0;     // 0 to disable overflow log
+  static const uint32_t TcpAckMsgs = 0;            // 0 to disable ack-only frames by msg count
+  static const uint32_t TcpAckBytes = 0;           // 0 to disable ack-only frames by bytes
+  static const int64_t TcpAckDelay = 0;            // 0 to disable ack-only frames by delay
+  static const int64_t TcpAckMinInterval = NanoInSecond / 10000;
+  static const uint32_t TcpZeroCopyMin = 0;        // 0 to disable MSG_ZEROCOPY
+  static const uint32_t TcpFlushBytes = 0;         // 0 to disable flushing PushMore by bytes
+  static const int64_t TcpFlushDelay = 0;          // 0 to disable flushing PushMore by delay
+  static const bool TcpFlushOnIdle = false;
+  static const uint32_t SendStagingSize = 0;       // 0 to disable StageAlloc(), must be a power of 2
+  static const bool MmapHugePage = false;
+  static const bool MmapPopulate = true;
+  static const bool MemLock = false;
 
   static const int64_t ConnectionTimeout = 10 * NanoInSecond;
   static const int64_t HeartBeatInverval = 3 * NanoInSecond;
+  static const uint32_t RecvBatchSize = 0;         // 0 to deliver msgs one by one
+  static const int64_t ShmWaitTimeout = 100000000; // in nanoseconds
 
   using ConnectionUserData = char;
 };
@@ -138,26 +156,26 @@ private:
 
 private:
     friend TSClient;
-    // called within Connect()
+    // called within Connect(), or PollTcp() after ConnectAsync()
     // reporting errors on connecting to the server
     void OnSystemError(const char* error_msg, int sys_errno) {
         cout << "System Error: " << error_msg << " syserrno: " << strerror(sys_errno) << endl;
     }
 
-    // called within Connect()
+    // called within Connect(), or PollTcp() after ConnectAsync()
     // Login rejected by server
     void OnLoginReject(const LoginRspMsg* login_rsp) {
         cout << "Login Rejected: " << login_rsp->error_msg << endl;
     }
 
-    // called within Connect()
+    // called within Connect(), or PollTcp() after ConnectAsync()
     // confirmation for login success
     int64_t OnLoginSuccess(const LoginRspMsg* login_rsp) {
         cout << "Login Success" << endl;
         return now();
     }
 
-    // called within Connect()
+    // called within Connect(), or PollTcp() after ConnectAsync()
     // server and client ptcp sequence number don't match, we need to fix it manually
     void OnSeqNumberMismatch(uint32_t local_ack_seq,
                              uint32_t local_seq_start,
@@ -184,6 +202,20 @@ private:
         conn.Pop();
     }
 
+    // called by APP thread if RecvBatchSize > 0
+    void OnServerMsgs(MsgHeader** headers, uint32_t cnt) {
+        for(uint32_t i = 0; i < cnt; i++) {
+            switch(headers[i]->msg_type) {
+                case 1: handleMsg((Msg1*)(headers[i] + 1)); break;
+                case 2: handleMsg((Msg2*)(headers[i] + 1)); break;
+                case 3: handleMsg((Msg3*)(headers[i] + 1)); break;
+                case 4: handleMsg((Msg4*)(headers[i] + 1)); break;
+                default: assert(false);
+            }
+        }
+        conn.PopN(cnt);
+    }
+
     // called by tcp thread
     void OnDisconnected(const char* reason, int sys_errno) {
         cout << "Client disconnected reason: " << reason << " syserrno: " << strerror(sys_errno) << endl;
@@ -13,21 +13,45 @@ struct ServerConf : public CommonConf
   static const int64_t NanoInSecond = 1000000000LL;
 
   static const uint32_t MaxNewConnections = 5;
+  static const int ListenBacklog = 128;
+  static const uint32_t ReusePortListeners = 0;    // 0 to accept new connections in PollCtl()
   static const uint32_t MaxShmConnsPerGrp = 4;
   static const uint32_t MaxShmGrps = 1;
   static const uint32_t MaxTcpConnsPerGrp = 4;
   static const uint32_t MaxTcpGrps = 1;
+  static const uint32_t TcpUringBufCnt = 0;       // 0 to disable io_uring
+  static const uint32_t TcpUringBufSize = 4096;
+  static const bool TcpEpoll = false;
+  static const bool RuntimeConnPool = false;      // if true, connections are allocated in Start()
 
   // echo server's TcpQueueSize should be larger than that of client if client is in fast mode
   // otherwise server's send queue could be blocked and ack_seq can only be sent through HB which is slow
   static const uint32_t TcpQueueSize = 3000;       // must be a multiple of 8
   static const uint32_t TcpRecvBufInitSize = 1000; // must be a multiple of 8
   static const uint32_t TcpRecvBufMaxSize = 2000;  // must be a multiple of 8
+  static const bool TcpRecvBufVRing = false;       // if true, TcpRecvBufMaxSize must be a multiple of 4096
   static const bool TcpNoDelay = true;
+  static const uint32_t TcpSyncBatch = 0;          // 0 to disable durable mode
+  static const int64_t TcpSyncInterval = NanoInSecond / 1000;
+  static const uint32_t TcpLogSegmentSize = 0;     // 0 to disable overflow log
+  static const uint32_t TcpAckMsgs = 0;            // 0 to disable ack-only frames by msg count
+  static const uint32_t TcpAckBytes = 0;           // 0 to disable ack-only frames by bytes
+  static const int64_t TcpAckDelay = 0;            // 0 to disable ack-only frames by delay
+  static const int64_t TcpAckMinInterval = NanoInSecond / 10000;
+  static const uint32_t TcpZeroCopyMin = 0;        // 0 to disable MSG_ZEROCOPY
+  static const uint32_t TcpFlushBytes = 0;         // 0 to disable flushing PushMore by bytes
+  static const int64_t TcpFlushDelay = 0;          // 0 to disable flushing PushMore by delay
+  static const bool TcpFlushOnIdle = false;
+  static const uint32_t SendStagingSize = 0;       // 0 to disable StageAlloc(), must be a power of 2
+  static const bool MmapHugePage = false;
+  static const bool MmapPopulate = true;
+  static const bool MemLock = false;
 
   static const int64_t NewConnectionTimeout = 3 * NanoInSecond;
   static const int64_t ConnectionTimeout = 10 * NanoInSecond;
   static const int64_t HeartBeatInverval = 3 * NanoInSecond;
+  static const uint32_t RecvBatchSize = 0;         // 0 to deliver msgs one by one
+  static const int64_t ShmWaitTimeout = 100000000; // in nanoseconds
 
   using ConnectionUserData = char;
 };
@@ -161,7 +185,7 @@ private:
 
     // called by APP thread
     void OnClientMsg(Connection& conn, MsgHeader* recv_header) {
-        auto size = recv_header->size - sizeof(MsgHeader);
+        auto size = recv_header->GetSize() - sizeof(MsgHeader);
         MsgHeader* send_header = conn.Alloc(size);
         if(!send_header) return;
         send_header->msg_type = recv_header->msg_type;
@@ -171,6 +195,28 @@ private:
         conn.Push();
     }
 
+    // called by APP thread if RecvBatchSize > 0
+    void OnClientMsgs(Connection& conn, MsgHeader** recv_headers, uint32_t cnt) {
+        for(uint32_t i = 0; i < cnt; i++) {
+            auto size = recv_headers[i]->GetSize() - sizeof(MsgHeader);
+            MsgHeader* send_header = conn.Alloc(size);
+            if(!send_header) {
+                conn.PopN(i);
+                conn.Flush(); // send out echos from PushMore()
+                return;
+            }
+            send_header->msg_type = recv_headers[i]->msg_type;
+            memcpy(send_header + 1, recv_headers[i] + 1, size);
+            if(i + 1 < cnt) {
+                conn.PushMore();
+                continue;
+            }
+            // pop all at once, then send out all echos together
+            conn.PopN(cnt);
+            conn.Push();
+        }
+    }
+
     static volatile bool stopped;
     // set do_cpupin to true to get more stable latency
     bool do_cpupin = true;
@@ -0,0 +1,259 @@
+#include <bits/stdc++.h>
+#include "../tcpshm_server.h"
+#include "../tcpshm_client.h"
+#include "timestamp.h"
+#include "common.h"
+
+using namespace std;
+using namespace tcpshm;
+
+// Test of flush policy with tcp epoll on server side:
+// client b logs on and stays idle so its server connection is waiting in epoll, then client a sends a msg and
+// server pushes a msg to b with PushMore() in OnClientMsg() of a, b should get it within TcpFlushDelay instead of
+// waiting for the next heartbeat
+// usage: ./epoll_flush_test
+
+const int64_t NanoInSecond = 1000000000LL;
+const uint16_t Port = 12346;
+const string PtcpDir = "epoll_flush_ptcp"; // referred by connections, so it must outlive them
+
+struct ServerConf : public CommonConf
+{
+  static const uint32_t MaxNewConnections = 5;
+  static const int ListenBacklog = 128;
+  static const uint32_t ReusePortListeners = 0;
+  static const uint32_t MaxShmConnsPerGrp = 4;
+  static const uint32_t MaxShmGrps = 1;
+  static const uint32_t MaxTcpConnsPerGrp = 4;
+  static const uint32_t MaxTcpGrps = 1;
+  static const uint32_t TcpUringBufCnt = 0;
+  static const uint32_t TcpUringBufSize = 4096;
+  static const bool TcpEpoll = true;
+  static const bool RuntimeConnPool = false;
+
+  static const uint32_t TcpQueueSize = 2000;
+  static const uint32_t TcpRecvBufInitSize = 1000;
+  static const uint32_t TcpRecvBufMaxSize = 2000;
+  static const bool TcpRecvBufVRing = false;
+  static const bool TcpNoDelay = true;
+  static const uint32_t TcpSyncBatch = 0;
+  static const int64_t TcpSyncInterval = NanoInSecond / 1000;
+  static const uint32_t TcpLogSegmentSize = 0;
+  static const uint32_t TcpAckMsgs = 0;
+  static const uint32_t TcpAckBytes = 0;
+  static const int64_t TcpAckDelay = 0;
+  static const int64_t TcpAckMinInterval = NanoInSecond / 10000;
+  static const uint32_t TcpZeroCopyMin = 0;
+  static const uint32_t TcpFlushBytes = 0;
+  static const int64_t TcpFlushDelay = NanoInSecond / 50; // what's tested
+  static const bool TcpFlushOnIdle = false;
+  static const uint32_t SendStagingSize = 0;
+  static const bool MmapHugePage = false;
+  static const bool MmapPopulate = true;
+  static const bool MemLock = false;
+
+  static const int64_t NewConnectionTimeout = 3 * NanoInSecond;
+  static const int64_t ConnectionTimeout = 20 * NanoInSecond;
+  static const int64_t HeartBeatInverval = 5 * NanoInSecond; // much longer than TcpFlushDelay
+  static const uint32_t RecvBatchSize = 0;
+  static const int64_t ShmWaitTimeout = 100000000;
+
+  using ConnectionUserData = char;
+};
+
+struct ClientConf : public CommonConf
+{
+  static const uint32_t TcpQueueSize = 2000;
+  static const uint32_t TcpRecvBufInitSize = 1000;
+  static const uint32_t TcpRecvBufMaxSize = 2000;
+  static const bool TcpRecvBufVRing = false;
+  static const bool TcpNoDelay = true;
+  static const uint32_t TcpSyncBatch = 0;
+  static const int64_t TcpSyncInterval = NanoInSecond / 1000;
+  static const uint32_t TcpLogSegmentSize = 0;
+  static const uint32_t TcpAckMsgs = 0;
+  static const uint32_t TcpAckBytes = 0;
+  static const int64_t TcpAckDelay = 0;
+  static const int64_t TcpAckMinInterval = NanoInSecond / 10000;
+  static const uint32_t TcpZeroCopyMin = 0;
+  static const uint32_t TcpFlushBytes = 0;
+  static const int64_t TcpFlushDelay = 0;
+  static const bool TcpFlushOnIdle = false;
+  static const uint32_t SendStagingSize = 0;
+  static const bool MmapHugePage = false;
+  static const bool MmapPopulate = true;
+  static const bool MemLock = false;
+
+  static const int64_t ConnectionTimeout = 20 * NanoInSecond;
+  static const int64_t HeartBeatInverval = 5 * NanoInSecond;
+  static const uint32_t RecvBatchSize = 0;
+  static const int64_t ShmWaitTimeout = 100000000;
+
+  using ConnectionUserData = char;
+};
+
+class Server;
+using TSServer = TcpShmServer<Server, ServerConf>;
+
+class Server : public TSServer
+{
+public:
+    Server()
+        : TSServer("server", PtcpDir) {}
+
+    void Run() {
+        if(!Start("127.0.0.1", Port)) exit(1);
+        while(!stopped) {
+            PollCtl(now());
+            PollTcp(now(), 0);
+        }
+        Stop();
+    }
+
+    atomic<bool> stopped{false};
+    atomic<bool> b_logon{false};
+    atomic<int64_t> push_time{0};
+
+private:
+    friend TSServer;
+
+    void OnSystemError(const char* error_msg, int sys_errno) {
+        cout << "Server System Error: " << error_msg << " syserrno: " << strerror(sys_errno) << endl;
+    }
+
+    int OnNewConnection(const struct sockaddr_in& addr, const LoginMsg* login, LoginRspMsg* login_rsp) {
+        return login->use_shm ? -1 : 0;
+    }
+
+    void OnClientFileError(Connection& conn, const char* reason, int sys_errno) {
+        cout << "Client file error, name: " << conn.GetRemoteName() << " reason: " << reason << endl;
+    }
+
+    void OnSeqNumberMismatch(Connection& conn, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t) {
+        cout << "Client seq number mismatch, name: " << conn.GetRemoteName() << endl;
+    }
+
+    void OnClientLogon(const struct sockaddr_in& addr, Connection& conn) {
+        if(strcmp(conn.GetRemoteName(), "b") == 0) {
+            conn_b = &conn;
+            b_logon = true;
+        }
+    }
+
+    void OnClientDisconnected(Connection& conn, const char* reason, int sys_errno) {
+        if(&conn == conn_b) conn_b = nullptr;
+    }
+
+    // push to b which is waiting in epoll, from the callback of a
+    void OnClientMsg(Connection& conn, MsgHeader* recv_header) {
+        if(conn_b) {
+            MsgHeader* header = conn_b->Alloc(sizeof(int64_t));
+            if(header) {
+                header->msg_type = 1;
+                conn_b->PushMore();
+                push_time = now();
+            }
+        }
+        conn.Pop();
+    }
+
+    Connection* conn_b = nullptr;
+};
+
+class Client;
+using TSClient = TcpShmClient<Client, ClientConf>;
+
+class Client : public TSClient
+{
+public:
+    Client(const char* name)
+        : TSClient(name, PtcpDir) {}
+
+    using TSClient::PollTcp;
+    using TSClient::Stop;
+
+    bool Connect() {
+        return TSClient::Connect(false, "127.0.0.1", Port, 0);
+    }
+
+    bool Send() {
+        MsgHeader* header = GetConnection().Alloc(sizeof(int64_t));
+        if(!header) return false;
+        header->msg_type = 1;
+        GetConnection().Push();
+        return true;
+    }
+
+    atomic<int64_t> recv_time{0};
+
+private:
+    friend TSClient;
+
+    void OnSystemError(const char* error_msg, int sys_errno) {
+        cout << "Client System Error: " << error_msg << " syserrno: " << strerror(sys_errno) << endl;
+    }
+
+    void OnLoginReject(const LoginRspMsg* login_rsp) {
+        cout << "Login Rejected: " << login_rsp->error_msg << endl;
+    }
+
+    int64_t OnLoginSuccess(const LoginRspMsg* login_rsp) {
+        return now();
+    }
+
+    void OnSeqNumberMismatch(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, uint32_t) {
+        cout << "Seq number mismatch" << endl;
+    }
+
+    void OnServerMsg(MsgHeader* header) {
+        recv_time = now();
+        GetConnection().Pop();
+    }
+
+    void OnDisconnected(const char* reason, int sys_errno) {
+        cout << "Client disconnected reason: " << reason << " syserrno: " << strerror(sys_errno) << endl;
+    }
+};
+
+int main() {
+    // start from empty ptcp files every time
+    if(system(("rm -rf " + PtcpDir).c_str()) != 0) return 1;
+    mkdir(PtcpDir.c_str(), 0755);
+
+    Server server;
+    thread server_thr([&]() { server.Run(); });
+    this_thread::sleep_for(chrono::milliseconds(100));
+
+    Client b("b");
+    if(!b.Connect()) return 1;
+    atomic<bool> b_stopped{false};
+    thread b_thr([&]() {
+        while(!b_stopped) b.PollTcp(now());
+    });
+    while(!server.b_logon) this_thread::sleep_for(chrono::milliseconds(1));
+    // let server connection of b go idle in epoll
+    this_thread::sleep_for(chrono::milliseconds(200));
+
+    Client a("a");
+    if(!a.Connect() || !a.Send()) return 1;
+    int64_t deadline = now() + 2 * NanoInSecond; // well before heartbeat of b's connection
+    while(!b.recv_time && (int64_t)now() < deadline) a.PollTcp(now());
+
+    b_stopped = true;
+    b_thr.join();
+    a.Stop();
+    b.Stop();
+    server.stopped = true;
+    server_thr.join();
+
+    if(!b.recv_time || !server.push_time) {
+        cout << "failed: msg from PushMore() is not received by b" << endl;
+        return 1;
+    }
+    int64_t delay = b.recv_time - server.push_time;
+    // allow some scheduling delay on top of TcpFlushDelay
+    bool ok = delay <= ServerConf::TcpFlushDelay + NanoInSecond / 10;
+    cout << (ok ? "passed" : "failed") << ": b got the msg " << delay / 1000000.0
+         << " ms after PushMore(), TcpFlushDelay: " << ServerConf::TcpFlushDelay / 1000000.0 << " ms" << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,92 @@
+#include <bits/stdc++.h>
+#include "../spsc_varq.h"
+#include "../mmap.h"
+#include "timestamp.h"
+#include "cpupin.h"
+
+using namespace std;
+using namespace tcpshm;
+
+// Throughput test of the shm queue between two threads on the same host:
+// writer pushes msgs carrying an increasing number, reader checks the numbers and pops them
+// usage: ./shmq_bench [msg_cnt] [msg_size] [burst] [writer_cpu] [reader_cpu]
+// if burst > 1, writer uses PushMore() and Push() for every burst msgs, and reader uses FrontBatch() and PopN()
+// cpu < 0 to disable cpupin
+
+const uint32_t QueueSize = 1024 * 1024;
+
+template<uint32_t BlkSize>
+void Bench(uint32_t msg_cnt, uint32_t msg_size, uint32_t burst, int writer_cpu, int reader_cpu) {
+    using SHMQ = SPSCVarQueue<QueueSize, BlkSize>;
+    const char* error_msg;
+    SHMQ* q = my_mmap<SHMQ>("/shmq_bench.shm", true, &error_msg, MMAP_POPULATE);
+    if(!q) {
+        cout << "System Error: " << error_msg << " syserrno: " << strerror(errno) << endl;
+        exit(1);
+    }
+    memset(q, 0, sizeof(SHMQ));
+
+    unsigned long long start_time = now();
+    thread writer([&]() {
+        if(writer_cpu >= 0) cpupin(writer_cpu);
+        for(uint32_t i = 0; i < msg_cnt;) {
+            MsgHeader* header = q->Alloc(msg_size);
+            if(!header) continue;
+            header->msg_type = 1;
+            *(uint32_t*)(header + 1) = i++;
+            if(i % burst)
+                q->PushMore();
+            else
+                q->Push();
+        }
+        q->Flush();
+    });
+
+    if(reader_cpu >= 0) cpupin(reader_cpu);
+    vector<MsgHeader*> headers(burst);
+    uint32_t expected = 0;
+    while(expected < msg_cnt) {
+        uint32_t cnt;
+        if(burst > 1) {
+            cnt = q->FrontBatch(headers.data(), burst);
+        }
+        else {
+            headers[0] = q->Front();
+            cnt = headers[0] ? 1 : 0;
+        }
+        for(uint32_t i = 0; i < cnt; i++) {
+            if(*(uint32_t*)(headers[i] + 1) != expected++) {
+                cout << "bad msg, expected: " << expected - 1 << endl;
+                exit(1);
+            }
+        }
+        if(burst > 1)
+            q->PopN(cnt);
+        else if(cnt)
+            q->Pop();
+    }
+    unsigned long long latency = now() - start_time;
+    writer.join();
+    my_munmap<SHMQ>(q);
+
+    cout << "BlkSize: " << BlkSize << " msg_size: " << msg_size << " burst: " << burst << " msg_cnt: " << msg_cnt
+         << " latency: " << latency << " avg: " << (double)latency / msg_cnt
+         << " ns, throughput: " << msg_cnt * 1000.0 / latency << " M msgs/s" << endl;
+}
+
+int main(int argc, const char** argv) {
+    uint32_t msg_cnt = argc > 1 ? atoi(argv[1]) : 100000000;
+    uint32_t msg_size = argc > 2 ? atoi(argv[2]) : 16;
+    uint32_t burst = argc > 3 ? atoi(argv[3]) : 1;
+    int writer_cpu = argc > 4 ? atoi(argv[4]) : 1;
+    int reader_cpu = argc > 5 ? atoi(argv[5]) : 2;
+    if(msg_size < sizeof(uint32_t) || burst == 0) {
+        cout << "msg_size must be at least 4 and burst must be positive" << endl;
+        return 1;
+    }
+
+    Bench<16>(msg_cnt, msg_size, burst, writer_cpu, reader_cpu);
+    Bench<64>(msg_cnt, msg_size, burst, writer_cpu, reader_cpu);
+    shm_unlink("/shmq_bench.shm");
+    return 0;
+}
@@ -0,0 +1,221 @@
+/*
+MIT License
+
+Copyright (c) 2018 Meng Rao <raomeng1@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#pragma once
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+
+namespace tcpshm {
+
+// Minimal single thread io_uring wrapper for receiving from a group of tcp sockets, using raw syscalls
+// Each socket has a multishot recv that picks buffers from a ring of provided buffers(kernel 6.0+), completions are
+// posted to the completion ring by kernel and reaped without syscall, so idle sockets cost nothing
+class TcpUring
+{
+public:
+    // buf_cnt must be a power of 2 and no more than 32768
+    bool Init(uint32_t buf_cnt, uint32_t buf_size, const char** error_msg) {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        // a socket could have multiple completions in ring, so make room for them
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = buf_cnt * 2;
+        if((fd_ = (int)syscall(__NR_io_uring_setup, buf_cnt, &p)) < 0) {
+            *error_msg = "io_uring_setup";
+            return false;
+        }
+        if(!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+            *error_msg = "io_uring single mmap not supported";
+            errno = 0;
+            Release();
+            return false;
+        }
+        ring_size_ = std::max(p.sq_off.array + p.sq_entries * sizeof(uint32_t),
+                              p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+        char* ring = (char*)mmap(0, ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        if(ring == MAP_FAILED) {
+            *error_msg = "mmap io_uring";
+            Release();
+            return false;
+        }
+        ring_ = ring;
+        sq_head_ = (uint32_t*)(ring + p.sq_off.head);
+        sq_tail_ = (uint32_t*)(ring + p.sq_off.tail);
+        sq_mask_ = *(uint32_t*)(ring + p.sq_off.ring_mask);
+        sq_array_ = (uint32_t*)(ring + p.sq_off.array);
+        cq_head_ = (uint32_t*)(ring + p.cq_off.head);
+        cq_tail_ = (uint32_t*)(ring + p.cq_off.tail);
+        cq_mask_ = *(uint32_t*)(ring + p.cq_off.ring_mask);
+        cqes_ = (struct io_uring_cqe*)(ring + p.cq_off.cqes);
+        sqe_cnt_ = p.sq_entries;
+        sqes_ = (struct io_uring_sqe*)mmap(
+            0, sqe_cnt_ * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+        if(sqes_ == MAP_FAILED) {
+            sqes_ = nullptr;
+            *error_msg = "mmap io_uring sqes";
+            Release();
+            return false;
+        }
+
+        // provided buffers and the ring of them are allocated together
+        buf_cnt_ = buf_cnt;
+        buf_size_ = buf_size;
+        bufs_size_ = buf_cnt * (sizeof(struct io_uring_buf) + buf_size);
+        char* bufs = (char*)mmap(0, bufs_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(bufs == MAP_FAILED) {
+            *error_msg = "mmap io_uring bufs";
+            Release();
+            return false;
+        }
+        buf_ring_ = (struct io_uring_buf*)bufs;
+        bufs_ = bufs + buf_cnt * sizeof(struct io_uring_buf);
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)buf_ring_;
+        reg.ring_entries = buf_cnt;
+        reg.bgid = 0;
+        if(syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            *error_msg = "io_uring register buf ring";
+            Release();
+            return false;
+        }
+        for(uint32_t i = 0; i < buf_cnt; i++) RecycleBuf(i);
+        return true;
+    }
+
+    void Release() {
+        if(buf_ring_) {
+            munmap(buf_ring_, bufs_size_);
+            buf_ring_ = nullptr;
+        }
+        if(sqes_) {
+            munmap(sqes_, sqe_cnt_ * sizeof(struct io_uring_sqe));
+            sqes_ = nullptr;
+        }
+        if(ring_) {
+            munmap(ring_, ring_size_);
+            ring_ = nullptr;
+        }
+        if(fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    bool IsInited() {
+        return fd_ >= 0;
+    }
+
+    uint32_t BufCnt() {
+        return buf_cnt_;
+    }
+
+    // queue a multishot recv on sockfd, it's submitted in Submit()
+    // return false if submission queue is full
+    bool Recv(int sockfd, uint64_t user_data) {
+        uint32_t tail = *sq_tail_;
+        if(tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sqe_cnt_) return false;
+        uint32_t idx = tail & sq_mask_;
+        struct io_uring_sqe* sqe = &sqes_[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = sockfd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = user_data;
+        sq_array_[idx] = idx;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        to_submit_++;
+        return true;
+    }
+
+    // submit all queued requests with one syscall
+    // return false if failed
+    bool Submit() {
+        if(to_submit_ == 0) return true;
+        int ret = (int)syscall(__NR_io_uring_enter, fd_, to_submit_, 0, 0, nullptr, 0);
+        if(ret < 0) return false;
+        to_submit_ -= ret;
+        return true;
+    }
+
+    // handler(user_data, res, flags) is called for each completion
+    template<typename Handler>
+    void Reap(Handler handler) {
+        uint32_t head = *cq_head_;
+        uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        if(head == tail) return;
+        for(; head != tail; head++) {
+            struct io_uring_cqe& cqe = cqes_[head & cq_mask_];
+            handler(cqe.user_data, cqe.res, cqe.flags);
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+
+    char* GetBuf(uint16_t bid) {
+        return bufs_ + (size_t)bid * buf_size_;
+    }
+
+    // give the buffer back to kernel
+    void RecycleBuf(uint16_t bid) {
+        // the tail of buf ring is overlaid with the resv field of the first entry
+        // we don't use io_uring_buf_ring as its flexible array is not laid out the same in C++
+        uint16_t* tail_ptr = &buf_ring_[0].resv;
+        uint16_t tail = *tail_ptr;
+        struct io_uring_buf& buf = buf_ring_[tail & (buf_cnt_ - 1)];
+        buf.addr = (uint64_t)GetBuf(bid);
+        buf.len = buf_size_;
+        buf.bid = bid;
+        __atomic_store_n(tail_ptr, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+    }
+
+private:
+    int fd_ = -1;
+    char* ring_ = nullptr;
+    size_t ring_size_ = 0;
+    uint32_t* sq_head_;
+    uint32_t* sq_tail_;
+    uint32_t sq_mask_;
+    uint32_t* sq_array_;
+    uint32_t* cq_head_;
+    uint32_t* cq_tail_;
+    uint32_t cq_mask_;
+    struct io_uring_cqe* cqes_;
+    struct io_uring_sqe* sqes_ = nullptr;
+    uint32_t sqe_cnt_ = 0;
+    uint32_t to_submit_ = 0;
+
+    struct io_uring_buf* buf_ring_ = nullptr;
+    char* bufs_;
+    size_t bufs_size_ = 0;
+    uint32_t buf_cnt_ = 0;
+    uint32_t buf_size_ = 0;
+};
+} // namespace tcpshm